@@ -0,0 +1,169 @@
+// adaptive_limit.cpp
+//
+// Adaptive session concurrency limit.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#include "adaptive_limit.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define UPDATE_INTERVAL       1.0      // seconds
+#define DECREASE_FACTOR       0.75
+#define RUN_QUEUE_FACTOR      1.5      // runnable tasks per CPU
+#define MEMORY_PRESSURE       10.0     // percent
+#define LATENCY_FACTOR        2.0
+#define BASELINE_DRIFT        1.02     // upward drift per interval
+
+//------------------------------------------------------------------------------
+// Returns the number of currently runnable tasks, excluding ourself,
+// or -1 if not available.
+//
+static int runQueueLength ()
+{
+   FILE* file = fopen ("/proc/loadavg", "r");
+   if (!file) return -1;
+
+   double load1, load5, load15;
+   int running = -1;
+   int total;
+   const int n = fscanf (file, "%lf %lf %lf %d/%d", &load1, &load5, &load15,
+                         &running, &total);
+   fclose (file);
+
+   return (n == 5) ? running - 1 : -1;
+}
+
+//------------------------------------------------------------------------------
+// Returns the memory pressure (some avg10) percentage, or -1.0 if PSI is not
+// available.
+//
+static double memoryPressure ()
+{
+   FILE* file = fopen ("/proc/pressure/memory", "r");
+   if (!file) return -1.0;
+
+   double avg10 = -1.0;
+   const int n = fscanf (file, "some avg10=%lf", &avg10);
+   fclose (file);
+
+   return (n == 1) ? avg10 : -1.0;
+}
+
+//------------------------------------------------------------------------------
+//
+void initialiseAdaptiveLimit (AdaptiveLimit* adaptive, const int maximum,
+                              const double timeNow)
+{
+   adaptive->numberCpus = sysconf (_SC_NPROCESSORS_ONLN);
+   if (adaptive->numberCpus < 1) adaptive->numberCpus = 1;
+
+   adaptive->minimum = 1;
+   adaptive->maximum = maximum;
+
+   // Start with one session per CPU, which we will adjust as required.
+   //
+   adaptive->limit = adaptive->numberCpus;
+   if (adaptive->limit > maximum) adaptive->limit = maximum;
+
+   adaptive->baselineLatency = -1.0;
+   adaptive->latencySum = 0.0;
+   adaptive->latencyCount = 0;
+   adaptive->lastUpdateTime = timeNow;
+   adaptive->wasConstraining = false;
+}
+
+//------------------------------------------------------------------------------
+//
+void recordSessionLatency (AdaptiveLimit* adaptive, const double duration)
+{
+   adaptive->latencySum += duration;
+   adaptive->latencyCount++;
+}
+
+//------------------------------------------------------------------------------
+//
+int updateAdaptiveLimit (AdaptiveLimit* adaptive, const bool isConstraining,
+                         const double timeNow)
+{
+   if (isConstraining) {
+      adaptive->wasConstraining = true;
+   }
+
+   if (timeNow < adaptive->lastUpdateTime + UPDATE_INTERVAL) {
+      return int (adaptive->limit);
+   }
+   adaptive->lastUpdateTime = timeNow;
+
+   // Gather the overload signals.
+   //
+   const int runQueue = runQueueLength ();
+   const double pressure = memoryPressure ();
+
+   double latency = -1.0;
+   if (adaptive->latencyCount > 0) {
+      latency = adaptive->latencySum / adaptive->latencyCount;
+      adaptive->latencySum = 0.0;
+      adaptive->latencyCount = 0;
+   }
+
+   const bool cpuOverload = runQueue > RUN_QUEUE_FACTOR * adaptive->numberCpus;
+   const bool memoryOverload = pressure > MEMORY_PRESSURE;
+   const bool latencyOverload = (latency >= 0.0) && (adaptive->baselineLatency > 0.0) &&
+                                (latency > LATENCY_FACTOR * adaptive->baselineLatency);
+
+   // Update the baseline latency. This is the minimum observed, but allowed to
+   // slowly drift upwards so that we can track a change in the filter cost.
+   //
+   if (adaptive->baselineLatency > 0.0) {
+      adaptive->baselineLatency *= BASELINE_DRIFT;
+   }
+   if ((latency > 0.0) &&
+       ((adaptive->baselineLatency <= 0.0) || (latency < adaptive->baselineLatency))) {
+      adaptive->baselineLatency = latency;
+   }
+
+   const double previous = adaptive->limit;
+
+   if (cpuOverload || memoryOverload || latencyOverload) {
+      adaptive->limit *= DECREASE_FACTOR;
+      if (adaptive->limit < adaptive->minimum) adaptive->limit = adaptive->minimum;
+
+   } else if (adaptive->wasConstraining) {
+      adaptive->limit += 1.0;
+      if (adaptive->limit > adaptive->maximum) adaptive->limit = adaptive->maximum;
+   }
+   adaptive->wasConstraining = false;
+
+   if (int (adaptive->limit) != int (previous)) {
+      fprintf (stdout, "Session limit: %d (run queue %d, memory pressure %.2f%%",
+               int (adaptive->limit), runQueue, pressure);
+      if (latency >= 0.0) {
+         fprintf (stdout, ", latency %.3f s, baseline %.3f s",
+                  latency, adaptive->baselineLatency);
+      }
+      fprintf (stdout, ")\n");
+   }
+
+   return int (adaptive->limit);
+}
+
+// end
@@ -0,0 +1,64 @@
+// adaptive_limit.h
+//
+// Adaptive session concurrency limit.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#ifndef ADAPTIVE_LIMIT_H
+#define ADAPTIVE_LIMIT_H
+
+// The limit is adjusted using AIMD (additive increase, multiplicative decrease)
+// once per update interval. The machine is deemed overloaded if any of the
+// following apply:
+//   - the run queue exceeds the number of online CPUs times a factor;
+//   - memory pressure (PSI, some avg10) exceeds a threshold percentage;
+//   - the mean latency of sessions completed during the interval exceeds
+//     the baseline (minimum observed, slowly drifting upwards) latency
+//     times a factor.
+// If overloaded, the limit is decreased, otherwise if the limit has prevented
+// a connection from being accepted it is increased by one.
+//
+struct AdaptiveLimit {
+   double limit;
+   int minimum;
+   int maximum;
+   int numberCpus;
+   double baselineLatency;    // < 0 if no baseline yet
+   double latencySum;
+   int latencyCount;
+   double lastUpdateTime;
+   bool wasConstraining;      // limit blocked a connection during this interval
+};
+
+void initialiseAdaptiveLimit (AdaptiveLimit* adaptive, const int maximum,
+                              const double timeNow);
+
+// Record the duration of a completed session.
+//
+void recordSessionLatency (AdaptiveLimit* adaptive, const double duration);
+
+// Notes whether the limit is currently preventing a pending connection from
+// being accepted, updates the limit if due and returns the current (integer)
+// limit.
+//
+int updateAdaptiveLimit (AdaptiveLimit* adaptive, const bool isConstraining,
+                         const double timeNow);
+
+#endif  // ADAPTIVE_LIMIT_H
@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# filter server benchmark scenarios, run entirely on localhost.
+#
+# Copyright (c) 2020 Andrew Starritt
+#
+# The filter server program is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# usage: bench.sh [base_port]
+#
+
+base_port=${1:-47100}
+here=$(cd $(dirname $0) && pwd)
+server=${here}/filter_server
+loader=${here}/load_generator
+pids=""
+
+cleanup () {
+    [ -n "${pids}" ] && kill ${pids} 2>/dev/null
+    wait 2>/dev/null
+}
+trap cleanup EXIT
+
+# start_server port options... -- command args...
+#
+start_server () {
+    local port=$1
+    shift
+    ${server} -s 100 "$@" > /dev/null 2>&1 &
+    pids="${pids} $!"
+    # Wait for the listener to be ready.
+    #
+    for j in $(seq 1 50) ; do
+        (exec 3<>/dev/tcp/127.0.0.1/${port}) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "failed to start server on port ${port}" >&2
+    exit 2
+}
+
+# scenario title port load_generator_options...
+#
+scenario () {
+    local title="$1"
+    local port=$2
+    shift 2
+    echo "=== ${title}"
+    ${loader} "$@" 127.0.0.1 ${port}
+    echo ""
+}
+
+p0=$((base_port + 0))
+p1=$((base_port + 1))
+p2=$((base_port + 2))
+p3=$((base_port + 3))
+p4=$((base_port + 4))
+p5=$((base_port + 5))
+p6=$((base_port + 6))
+
+start_server ${p0} -- ${p0} cat
+start_server ${p1} -- ${p1} tr 'a-z' 'A-Z'
+start_server ${p2} -u -z -- ${p2} cat
+start_server ${p3} --backlog 128 -- ${p3} tr 'a-z' 'A-Z'
+start_server ${p4} --defer-accept 5 -- ${p4} tr 'a-z' 'A-Z'
+start_server ${p5} --nodelay -- ${p5} tr 'a-z' 'A-Z'
+start_server ${p6} --backlog 128 --defer-accept 5 --nodelay -- ${p6} tr 'a-z' 'A-Z'
+
+scenario "cat, 64 bytes, 8 clients (connection rate)"       ${p0} -c 8 -n 2000 -s 64
+scenario "cat, 64 KiB, 8 clients"                           ${p0} -c 8 -n 1000 -s 64k
+scenario "cat, 4 MiB, 4 clients (throughput)"               ${p0} -c 4 -n 100  -s 4M
+scenario "tr, 64 KiB, 8 clients"                            ${p1} -c 8 -n 1000 -s 64k
+scenario "tr, 200 connections/s for 5 s (latency)"          ${p1} -c 16 -d 5 -r 200 -s 1k
+scenario "gunzip | cat | gzip, 1 MiB compressed, 4 clients" ${p2} -c 4 -n 200 -s 1M -z
+
+# Socket tuning: same load, default socket options, then one option at a
+# time, then all together.
+#
+scenario "tr, 1 KiB, 32 clients, default socket options"    ${p1} -c 32 -n 2000 -s 1k
+scenario "tr, 1 KiB, 32 clients, backlog 128"               ${p3} -c 32 -n 2000 -s 1k
+scenario "tr, 1 KiB, 32 clients, defer accept 5"            ${p4} -c 32 -n 2000 -s 1k
+scenario "tr, 1 KiB, 32 clients, nodelay"                   ${p5} -c 32 -n 2000 -s 1k
+scenario "tr, 1 KiB, 32 clients, backlog/defer/nodelay"     ${p6} -c 32 -n 2000 -s 1k
+
+# end
@@ -0,0 +1,241 @@
+// capture.cpp
+//
+// Session traffic capture, for replay by filter_replay.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+
+#include "capture.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CHUNK_SIZE            65536
+
+static const char* capturePath = NULL;
+static bool isCapturing = false;
+static uint64_t captureSessionId = 0;
+static double captureAcceptTime = 0.0;
+static const char* captureService = "";
+static char captureClient [64] = "";
+
+//------------------------------------------------------------------------------
+//
+double captureTimeNow ()
+{
+   struct timespec spec;
+   clock_gettime (CLOCK_REALTIME, &spec);
+   return double (spec.tv_sec) + double (spec.tv_nsec) / 1.0e9;
+}
+
+//------------------------------------------------------------------------------
+//
+uint64_t captureHash (uint64_t hash, const void* data, const size_t size)
+{
+   const unsigned char* p = (const unsigned char*) data;
+   for (size_t j = 0; j < size; j++) {
+      hash ^= p [j];
+      hash *= 1099511628211ULL;
+   }
+   return hash;
+}
+
+//------------------------------------------------------------------------------
+//
+bool openCaptureFile (const char* path)
+{
+   const int fd = open (path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+   if (fd < 0) {
+      perror (path);
+      return false;
+   }
+
+   struct stat info;
+   if ((fstat (fd, &info) == 0) && (info.st_size == 0)) {
+      if (write (fd, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != CAPTURE_MAGIC_SIZE) {
+         perror (path);
+         close (fd);
+         return false;
+      }
+   }
+   close (fd);
+
+   // Each capture stage opens the file for itself, as sessions close all
+   // inherited files.
+   //
+   capturePath = path;
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+void beginCaptureSession (const uint64_t sessionId, const double acceptTime,
+                          const char* serviceName, const char* clientAddress)
+{
+   isCapturing = capturePath != NULL;
+   captureSessionId = sessionId;
+   captureAcceptTime = acceptTime;
+   captureService = serviceName;
+   snprintf (captureClient, sizeof (captureClient), "%s", clientAddress);
+}
+
+//------------------------------------------------------------------------------
+//
+bool isCaptureSession ()
+{
+   return isCapturing;
+}
+
+//------------------------------------------------------------------------------
+// Writes a record as a single write.
+//
+static void writeRecord (const int fd, const CaptureRecordType type, const double time,
+                         const void* payload, const size_t length)
+{
+   static char* buffer = NULL;
+   if (!buffer) buffer = (char*) malloc (sizeof (CaptureRecordHeader) + CHUNK_SIZE);
+
+   CaptureRecordHeader header;
+   memset (&header, 0, sizeof (header));
+   header.type = type;
+   header.length = uint32_t (length);
+   header.sessionId = captureSessionId;
+   header.time = time;
+
+   memcpy (buffer, &header, sizeof (header));
+   if (length > 0) memcpy (buffer + sizeof (header), payload, length);
+
+   const ssize_t size = ssize_t (sizeof (header) + length);
+   if (write (fd, buffer, size) != size) {
+      perror ("capture write");
+   }
+}
+
+//------------------------------------------------------------------------------
+// Writes all the data to stdout. Returns false on error.
+//
+static bool writeAll (const char* data, const size_t size)
+{
+   for (size_t done = 0; done < size; ) {
+      const ssize_t n = write (STDOUT_FILENO, data + done, size - done);
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         return false;
+      }
+      done += n;
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// NOTE: This function does not return.
+//
+void runCaptureInput ()
+{
+   signal (SIGPIPE, SIG_IGN);
+   const int fd = open (capturePath, O_WRONLY | O_APPEND);
+   if (fd < 0) {
+      perror (capturePath);
+      _exit (4);
+   }
+
+   char metadata [256];
+   const int metadataSize = snprintf (metadata, sizeof (metadata), "%s%c%s%c",
+                                      captureService, '\0', captureClient, '\0');
+   writeRecord (fd, crSessionStart, captureAcceptTime, metadata,
+                size_t (metadataSize) < sizeof (metadata) ? metadataSize : sizeof (metadata));
+
+   char buffer [CHUNK_SIZE];
+   while (true) {
+      const ssize_t n = read (STDIN_FILENO, buffer, sizeof (buffer));
+      if (n == 0) break;
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         break;
+      }
+
+      writeRecord (fd, crInputData, captureTimeNow (), buffer, n);
+      if (!writeAll (buffer, n)) break;
+   }
+
+   writeRecord (fd, crInputEnd, captureTimeNow (), NULL, 0);
+   _exit (0);
+}
+
+//------------------------------------------------------------------------------
+// NOTE: This function does not return.
+//
+void runCaptureOutput ()
+{
+   signal (SIGPIPE, SIG_IGN);
+   const int fd = open (capturePath, O_WRONLY | O_APPEND);
+   if (fd < 0) {
+      perror (capturePath);
+      _exit (4);
+   }
+
+   CaptureOutputSummary summary;
+   summary.outputLength = 0;
+   summary.outputHash = CAPTURE_HASH_INIT;
+
+   char buffer [CHUNK_SIZE];
+   while (true) {
+      const ssize_t n = read (STDIN_FILENO, buffer, sizeof (buffer));
+      if (n == 0) break;
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         break;
+      }
+
+      summary.outputLength += n;
+      summary.outputHash = captureHash (summary.outputHash, buffer, n);
+      if (!writeAll (buffer, n)) break;
+   }
+
+   writeRecord (fd, crSessionEnd, captureTimeNow (), &summary, sizeof (summary));
+   _exit (0);
+}
+
+//------------------------------------------------------------------------------
+//
+bool readCaptureRecord (FILE* file, CaptureRecordHeader& header,
+                        char*& payload, size_t& capacity)
+{
+   if (fread (&header, sizeof (header), 1, file) != 1) return false;
+
+   if (header.length > capacity) {
+      capacity = header.length;
+      payload = (char*) realloc (payload, capacity);
+      if (!payload) return false;
+   }
+
+   if ((header.length > 0) && (fread (payload, header.length, 1, file) != 1)) {
+      return false;
+   }
+   return true;
+}
+
+// end
@@ -0,0 +1,105 @@
+// capture.h
+//
+// Session traffic capture, for replay by filter_replay.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// The capture file is an append-only sequence of records, preceded by the
+// CAPTURE_MAGIC file header. Each record is a CaptureRecordHeader followed by
+// length bytes of payload. Records from concurrent sessions are interleaved,
+// but each record is written with a single write to the O_APPEND file, so
+// records are never split. Values are in host byte order.
+//
+// When capturing, each session has two in-server stages, one between the
+// connection and the filter's input (or gunzip) and one between the filter's
+// output (or gzip) and the connection, i.e. the bytes captured are the
+// bytes received and sent on the connection (after TLS decryption).
+//
+
+#define CAPTURE_MAGIC         "FSCAPTURE-1\n"
+#define CAPTURE_MAGIC_SIZE    12
+
+#define CAPTURE_INPUT_STAGE   "@capture-input"
+#define CAPTURE_OUTPUT_STAGE  "@capture-output"
+
+enum CaptureRecordType {
+   crSessionStart = 1,        // payload: service name '\0' client address '\0'
+   crInputData = 2,           // payload: the input bytes
+   crInputEnd = 3,            // no payload
+   crSessionEnd = 4           // payload: CaptureOutputSummary
+};
+
+struct CaptureRecordHeader {
+   uint8_t type;              // CaptureRecordType
+   uint8_t spare [3];
+   uint32_t length;           // payload length
+   uint64_t sessionId;
+   double time;               // wall clock, seconds since epoch
+};
+
+struct CaptureOutputSummary {
+   uint64_t outputLength;
+   uint64_t outputHash;       // FNV-1a 64 bit of all output bytes
+};
+
+// Opens (creating if needs be) the capture file, writing the file header if
+// the file is empty. Called by the server at start up.
+// Returns false (and reports the error) on failure.
+//
+bool openCaptureFile (const char* path);
+
+// Sets the capture details of the session, called in the session process.
+//
+void beginCaptureSession (const uint64_t sessionId, const double acceptTime,
+                          const char* serviceName, const char* clientAddress);
+
+// Returns true if the session is being captured.
+//
+bool isCaptureSession ();
+
+// Copy stdin to stdout, capturing the input / the output summary, then exit.
+// NOTE: These functions do not return.
+//
+void runCaptureInput ();
+void runCaptureOutput ();
+
+// Current wall clock time, seconds since epoch.
+//
+double captureTimeNow ();
+
+// Updates a FNV-1a 64 bit hash, initial value CAPTURE_HASH_INIT.
+//
+#define CAPTURE_HASH_INIT     14695981039346656037ULL
+uint64_t captureHash (uint64_t hash, const void* data, const size_t size);
+
+// Reads the next record from the capture file. The payload buffer is
+// (re)allocated as needed. Returns false at end of file or on error.
+//
+bool readCaptureRecord (FILE* file, CaptureRecordHeader& header,
+                        char*& payload, size_t& capacity);
+
+#endif  // CAPTURE_H
@@ -0,0 +1,291 @@
+// cgroup.cpp
+//
+// Simple cgroup v2 support for per session resource isolation.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#include "cgroup.h"
+#include "utilities.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CPU_PERIOD            100000      // micro seconds
+#define MAXIMUM_PENDING       100
+
+// Cgroups that could not be removed when the session completed.
+//
+static char pendingRemovals [MAXIMUM_PENDING][CGROUP_PATH_SIZE];
+static int numberPending = 0;
+
+//------------------------------------------------------------------------------
+// Writes text to the named file within the cgroup directory.
+//
+static bool writeCgroupFile (const char* path, const char* name, const char* text)
+{
+   char filename [CGROUP_PATH_SIZE + 40];
+   snprintf (filename, sizeof (filename), "%s/%s", path, name);
+
+   const int fd = open (filename, O_WRONLY);
+   if (fd < 0) {
+      perrorf ("open (%s)", filename);
+      return false;
+   }
+
+   const ssize_t length = strlen (text);
+   const ssize_t count = write (fd, text, length);
+   if (count != length) {
+      perrorf ("write (%s, \"%s\")", filename, text);
+      close (fd);
+      return false;
+   }
+
+   close (fd);
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Reads the named file within the cgroup directory into buffer.
+//
+static bool readCgroupFile (const char* path, const char* name,
+                            char* buffer, const size_t size)
+{
+   char filename [CGROUP_PATH_SIZE + 40];
+   snprintf (filename, sizeof (filename), "%s/%s", path, name);
+
+   const int fd = open (filename, O_RDONLY);
+   if (fd < 0) {
+      return false;
+   }
+
+   const ssize_t count = read (fd, buffer, size - 1);
+   close (fd);
+   if (count < 0) {
+      return false;
+   }
+
+   buffer [count] = '\0';
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+bool initialiseCgroups (const char* parentPath, const CgroupLimits* limits)
+{
+   char controllers [200];
+   if (!readCgroupFile (parentPath, "cgroup.controllers",
+                        controllers, sizeof (controllers))) {
+      fprintf (stderr, "%s is not a cgroup v2 directory\n", parentPath);
+      return false;
+   }
+
+   if (strlen (parentPath) > CGROUP_PATH_SIZE - 40) {
+      fprintf (stderr, "cgroup path %s too long\n", parentPath);
+      return false;
+   }
+
+   // Enable the controllers we need in the subtree. The memory controller is
+   // always enabled, if available, as it provides memory.peak for reporting.
+   // The cpu controller is not required to just read usage from cpu.stat.
+   //
+   const bool hasMemory = strstr (controllers, "memory") != NULL;
+   char controls [40] = "";
+   if (hasMemory || (limits->memoryMax > 0.0)) strcat (controls, "+memory ");
+   if (limits->cpuMax > 0.0)    strcat (controls, "+cpu ");
+   if (limits->pidsMax > 0)     strcat (controls, "+pids ");
+
+   if (strlen (controls) == 0) {
+      return true;    // nothing to enable
+   }
+
+   int fd;
+   char filename [CGROUP_PATH_SIZE + 40];
+   snprintf (filename, sizeof (filename), "%s/cgroup.subtree_control", parentPath);
+
+   for (int attempt = 0; attempt < 2; attempt++) {
+      fd = open (filename, O_WRONLY);
+      if (fd < 0) {
+         perrorf ("open (%s)", filename);
+         return false;
+      }
+
+      const ssize_t length = strlen (controls);
+      const ssize_t count = write (fd, controls, length);
+      const int error = errno;
+      close (fd);
+
+      if (count == length) {
+         return true;
+      }
+
+      if ((error != EBUSY) || (attempt > 0)) {
+         errno = error;
+         perrorf ("write (%s, \"%s\")", filename, controls);
+         return false;
+      }
+
+      // Controllers can't be enabled while processes, i.e. this server, reside
+      // in the parent cgroup (the "no internal processes" rule). Move ourself
+      // into a leaf cgroup and try again.
+      //
+      char serverPath [CGROUP_PATH_SIZE];
+      snprintf (serverPath, sizeof (serverPath), "%s/server", parentPath);
+      const int status = mkdir (serverPath, 0755);
+      if ((status < 0) && (errno != EEXIST)) {
+         perrorf ("mkdir (%s)", serverPath);
+         return false;
+      }
+      if (!joinCgroup (serverPath)) {
+         return false;
+      }
+   }
+
+   return false;
+}
+
+//------------------------------------------------------------------------------
+//
+bool createSessionCgroup (const char* parentPath, const int sessionNumber,
+                          const CgroupLimits* limits,
+                          char* path, const size_t size)
+{
+   char text [40];
+   int status;
+
+   // Include the server pid, so that a successor server (see reload) never
+   // shares a cgroup with a session of its predecessor.
+   //
+   snprintf (path, size, "%s/session-%d-%d", parentPath, int (getpid ()), sessionNumber);
+
+   status = mkdir (path, 0755);
+   if (status < 0) {
+      perrorf ("mkdir (%s)", path);
+      return false;
+   }
+
+   bool result = true;
+   if (limits->memoryMax > 0.0) {
+      snprintf (text, sizeof (text), "%.0f", limits->memoryMax);
+      result &= writeCgroupFile (path, "memory.max", text);
+   }
+   if (limits->cpuMax > 0.0) {
+      snprintf (text, sizeof (text), "%.0f %d", limits->cpuMax * CPU_PERIOD, CPU_PERIOD);
+      result &= writeCgroupFile (path, "cpu.max", text);
+   }
+   if (limits->pidsMax > 0) {
+      snprintf (text, sizeof (text), "%d", limits->pidsMax);
+      result &= writeCgroupFile (path, "pids.max", text);
+   }
+
+   if (!result) {
+      rmdir (path);
+   }
+
+   return result;
+}
+
+//------------------------------------------------------------------------------
+//
+bool joinCgroup (const char* path)
+{
+   return writeCgroupFile (path, "cgroup.procs", "0");
+}
+
+//------------------------------------------------------------------------------
+//
+void reportSessionCgroup (const char* path, const int pid)
+{
+   char buffer [400];
+
+   double peakMemory = -1.0;
+   if (readCgroupFile (path, "memory.peak", buffer, sizeof (buffer))) {
+      sscanf (buffer, "%lf", &peakMemory);
+   }
+
+   double usage = -1.0;
+   double user = -1.0;
+   double system = -1.0;
+   if (readCgroupFile (path, "cpu.stat", buffer, sizeof (buffer))) {
+      // The lines of interest are of the form: "usage_usec 1234"
+      //
+      for (char* line = strtok (buffer, "\n"); line; line = strtok (NULL, "\n")) {
+         sscanf (line, "usage_usec %lf", &usage);
+         sscanf (line, "user_usec %lf", &user);
+         sscanf (line, "system_usec %lf", &system);
+      }
+   }
+
+   if (peakMemory >= 0.0) {
+      fprintf (stdout, "Process %d peak memory: %.2f MiB\n", pid, peakMemory / 1048576.0);
+   } else {
+      fprintf (stdout, "Process %d peak memory: n/a\n", pid);
+   }
+
+   if (usage >= 0.0) {
+      fprintf (stdout, "Process %d cpu usage:   %.3f s (user %.3f s, system %.3f s)\n",
+               pid, usage / 1.0e6, user / 1.0e6, system / 1.0e6);
+   } else {
+      fprintf (stdout, "Process %d cpu usage:   n/a\n", pid);
+   }
+}
+
+//------------------------------------------------------------------------------
+//
+void removeSessionCgroup (const char* path)
+{
+   const int status = rmdir (path);
+   if (status == 0) return;
+
+   if ((errno == EBUSY) && (numberPending < MAXIMUM_PENDING)) {
+      // Still populated, try again later.
+      //
+      snprintf (pendingRemovals [numberPending], CGROUP_PATH_SIZE, "%s", path);
+      numberPending++;
+      return;
+   }
+
+   perrorf ("rmdir (%s)", path);
+}
+
+//------------------------------------------------------------------------------
+//
+void tidyCgroups ()
+{
+   int j = 0;
+   while (j < numberPending) {
+      const int status = rmdir (pendingRemovals [j]);
+      if ((status == 0) || (errno != EBUSY)) {
+         // Done (or hopeless) - remove from list by moving the last item.
+         //
+         numberPending--;
+         if (j < numberPending) {
+            memcpy (pendingRemovals [j], pendingRemovals [numberPending], CGROUP_PATH_SIZE);
+         }
+      } else {
+         j++;
+      }
+   }
+}
+
+// end
@@ -0,0 +1,73 @@
+// cgroup.h
+//
+// Simple cgroup v2 support for per session resource isolation.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stddef.h>
+
+#define CGROUP_PATH_SIZE      256
+
+// Resource limits applied to each session cgroup.
+// Zero means no limit, i.e. "max".
+//
+struct CgroupLimits {
+   double memoryMax;          // bytes
+   double cpuMax;             // number of CPUs, e.g. 0.5, 2.0
+   int pidsMax;               // number of processes/threads
+};
+
+// Checks the delegated parent cgroup directory and enables the memory (always,
+// for peak memory reporting), cpu and pids controllers for its children as
+// required by the limits.
+// Returns false if unusable.
+//
+bool initialiseCgroups (const char* parentPath, const CgroupLimits* limits);
+
+// Creates a session cgroup, named session-<server pid>-<session number>, under
+// the parent cgroup and applies limits. The path of the new cgroup is returned
+// in path. Returns false on failure, including if the cgroup already exists.
+//
+bool createSessionCgroup (const char* parentPath, const int sessionNumber,
+                          const CgroupLimits* limits,
+                          char* path, const size_t size);
+
+// Moves the calling process into the specified cgroup.
+// Intended to be called by the child process prior to exec.
+//
+bool joinCgroup (const char* path);
+
+// Reports session peak memory and CPU usage to stdout.
+//
+void reportSessionCgroup (const char* path, const int pid);
+
+// Removes the session cgroup. If still in use (e.g. an orphaned post
+// process is still running), removal is deferred - see tidyCgroups.
+//
+void removeSessionCgroup (const char* path);
+
+// Retries any deferred cgroup removals.
+//
+void tidyCgroups ();
+
+#endif  // CGROUP_H
@@ -0,0 +1,607 @@
+// filter_replay.cpp
+//
+// Replays a filter_server capture file against a server, comparing output and latency.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define BUFFER_SIZE           65536
+
+//------------------------------------------------------------------------------
+// Replay parameters.
+//
+static const char* host = "localhost";
+static const char* port = NULL;
+static double speed = 1.0;             // 0 means as fast as possible
+static int maximumConcurrent = 100;
+static const char* serviceName = NULL;
+static double maximumSlowdown = 0.0;   // 0 means no latency check
+static bool isVerbose = false;
+
+static struct addrinfo* serverAddress = NULL;
+
+// A chunk of session input, as received by the server.
+//
+struct Chunk {
+   double offset;             // seconds since session start
+   size_t start;              // into Session data
+   size_t length;
+};
+
+// A captured session, and the replay results.
+//
+struct Session {
+   uint64_t id;
+   char service [64];
+   char client [64];
+   double startTime;          // wall clock, i.e. arrival time
+   Chunk* chunks;
+   int numberChunks;
+   int chunkCapacity;
+   char* data;
+   size_t dataLength;
+   size_t dataCapacity;
+   bool hasInputEnd;
+   double inputEndOffset;
+   bool hasEnd;
+   double endOffset;
+   uint64_t outputLength;
+   uint64_t outputHash;
+
+   bool isReplayed;           // completed without error
+   const char* failure;       // else the failed operation
+   int failureErrno;          // and errno, 0 if not applicable
+   uint64_t replayLength;
+   uint64_t replayHash;
+   double replayLatency;
+};
+
+static Session* sessions = NULL;
+static int numberSessions = 0;
+static int sessionCapacity = 0;
+
+static pthread_mutex_t slotMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slotCondition = PTHREAD_COND_INITIALIZER;
+static int numberRunning = 0;
+
+//------------------------------------------------------------------------------
+//
+static double timeNow ()
+{
+   struct timespec spec;
+   clock_gettime (CLOCK_MONOTONIC, &spec);
+   return double (spec.tv_sec) + double (spec.tv_nsec) / 1.0e9;
+}
+
+//------------------------------------------------------------------------------
+//
+static void sleepUntil (const double when)
+{
+   const double wait = when - timeNow ();
+   if (wait > 0.0) usleep (useconds_t (wait * 1.0e6));
+}
+
+//------------------------------------------------------------------------------
+//
+static void printUsage (FILE* stream)
+{
+   fprintf (stream,
+            "\n"
+            "usage: filter_replay [OPTIONS] capture_file [host] port\n"
+            "\n"
+            "--speed, -x        Replay speed factor, e.g. 2 replays twice as fast as\n"
+            "                   captured; 0 replays as fast as possible (default 1).\n"
+            "--service, -S      Only replay sessions captured for this service.\n"
+            "--concurrency, -c  Maximum concurrent sessions (default 100).\n"
+            "--max-slowdown, -m Fail if the replayed median latency exceeds the captured\n"
+            "                   median latency by more than this factor, e.g. 1.2.\n"
+            "                   Requires a speed of 1.\n"
+            "--verbose, -v      Report each session.\n"
+            "--help, -h         Show this help information and exit.\n"
+            "\n");
+}
+
+//------------------------------------------------------------------------------
+//
+static Session* findSession (const uint64_t id)
+{
+   // Records for a session are close together, so search from the end.
+   //
+   for (int j = numberSessions - 1; j >= 0; j--) {
+      if (sessions [j].id == id) return &sessions [j];
+   }
+   return NULL;
+}
+
+//------------------------------------------------------------------------------
+//
+static bool loadCapture (const char* filename)
+{
+   FILE* file = fopen (filename, "rb");
+   if (!file) {
+      perror (filename);
+      return false;
+   }
+
+   char magic [CAPTURE_MAGIC_SIZE];
+   if ((fread (magic, CAPTURE_MAGIC_SIZE, 1, file) != 1) ||
+       (memcmp (magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0)) {
+      fprintf (stderr, "%s is not a filter_server capture file\n", filename);
+      fclose (file);
+      return false;
+   }
+
+   CaptureRecordHeader header;
+   char* payload = NULL;
+   size_t capacity = 0;
+
+   while (readCaptureRecord (file, header, payload, capacity)) {
+      Session* session = findSession (header.sessionId);
+
+      if (header.type == crSessionStart) {
+         if (numberSessions >= sessionCapacity) {
+            sessionCapacity = 2 * sessionCapacity + 64;
+            sessions = (Session*) realloc (sessions, sizeof (Session) * sessionCapacity);
+         }
+         session = &sessions [numberSessions++];
+         memset (session, 0, sizeof (Session));
+         session->id = header.sessionId;
+         session->startTime = header.time;
+
+         // Payload is service '\0' client '\0'
+         //
+         const size_t serviceLength = strnlen (payload, header.length);
+         snprintf (session->service, sizeof (session->service), "%.*s",
+                   int (serviceLength), payload);
+         if (serviceLength + 1 < header.length) {
+            snprintf (session->client, sizeof (session->client), "%.*s",
+                      int (header.length - serviceLength - 1), payload + serviceLength + 1);
+         }
+         continue;
+      }
+
+      if (!session) continue;   // e.g. capture started part way through a session
+
+      const double offset = header.time - session->startTime;
+      switch (header.type) {
+         case crInputData:
+            if (session->numberChunks >= session->chunkCapacity) {
+               session->chunkCapacity = 2 * session->chunkCapacity + 16;
+               session->chunks = (Chunk*) realloc (session->chunks,
+                                                   sizeof (Chunk) * session->chunkCapacity);
+            }
+            if (session->dataLength + header.length > session->dataCapacity) {
+               session->dataCapacity = 2 * (session->dataLength + header.length);
+               session->data = (char*) realloc (session->data, session->dataCapacity);
+            }
+            memcpy (session->data + session->dataLength, payload, header.length);
+            session->chunks [session->numberChunks].offset = offset;
+            session->chunks [session->numberChunks].start = session->dataLength;
+            session->chunks [session->numberChunks].length = header.length;
+            session->numberChunks++;
+            session->dataLength += header.length;
+            break;
+
+         case crInputEnd:
+            session->hasInputEnd = true;
+            session->inputEndOffset = offset;
+            break;
+
+         case crSessionEnd:
+            if (header.length >= sizeof (CaptureOutputSummary)) {
+               const CaptureOutputSummary* summary = (const CaptureOutputSummary*) payload;
+               session->hasEnd = true;
+               session->endOffset = offset;
+               session->outputLength = summary->outputLength;
+               session->outputHash = summary->outputHash;
+            }
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   free (payload);
+   fclose (file);
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Replays one session, sending each chunk at its captured time (scaled by
+// speed) and reading the output concurrently.
+//
+static void replaySession (Session* session, char* buffer)
+{
+   #define FAIL(operation, error) {            \
+      session->failure = operation;            \
+      session->failureErrno = error;           \
+      isOkay = false;                          \
+   }
+
+   bool isOkay = true;
+   session->isReplayed = false;
+
+   const int fd = socket (serverAddress->ai_family, serverAddress->ai_socktype,
+                          serverAddress->ai_protocol);
+   if (fd < 0) {
+      FAIL ("socket", errno);
+      return;
+   }
+
+   const double t0 = timeNow ();
+   if (connect (fd, serverAddress->ai_addr, serverAddress->ai_addrlen) < 0) {
+      FAIL ("connect", errno);
+      close (fd);
+      return;
+   }
+   fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | O_NONBLOCK);
+
+   #define DUE(offset) (speed > 0.0 ? t0 + (offset) / speed : t0)
+
+   int chunk = 0;
+   size_t sent = 0;           // of current chunk
+   bool isShutdown = false;
+   session->replayLength = 0;
+   session->replayHash = CAPTURE_HASH_INIT;
+
+   while (true) {
+      const double now = timeNow ();
+      bool wantWrite = false;
+      double nextDue = -1.0;
+
+      if (chunk < session->numberChunks) {
+         const Chunk* item = &session->chunks [chunk];
+         if (now >= DUE (item->offset)) {
+            const ssize_t n = send (fd, session->data + item->start + sent,
+                                    item->length - sent, MSG_NOSIGNAL);
+            if (n > 0) {
+               sent += n;
+               if (sent >= item->length) {
+                  chunk++;
+                  sent = 0;
+                  continue;
+               }
+            } else if ((n < 0) && (errno != EAGAIN)) {
+               FAIL ("send", errno);
+               break;
+            }
+            wantWrite = true;
+         } else {
+            nextDue = DUE (item->offset);
+         }
+      } else if (!isShutdown) {
+         const double due = session->hasInputEnd ? DUE (session->inputEndOffset) : now;
+         if (now >= due) {
+            shutdown (fd, SHUT_WR);
+            isShutdown = true;
+         } else {
+            nextDue = due;
+         }
+      }
+
+      struct pollfd item;
+      item.fd = fd;
+      item.events = POLLIN | (wantWrite ? POLLOUT : 0);
+      item.revents = 0;
+
+      int timeout = 60000;
+      if (nextDue >= 0.0) {
+         timeout = int (1000.0 * (nextDue - now)) + 1;
+      }
+
+      const int status = poll (&item, 1, timeout);
+      if (status < 0) {
+         if (errno == EINTR) continue;
+         FAIL ("poll", errno);
+         break;
+      }
+      if ((status == 0) && (nextDue < 0.0)) {
+         FAIL ("no response in 60 s", 0);
+         break;
+      }
+
+      if (item.revents & (POLLIN | POLLHUP | POLLERR)) {
+         const ssize_t n = recv (fd, buffer, BUFFER_SIZE, 0);
+         if (n > 0) {
+            session->replayLength += n;
+            session->replayHash = captureHash (session->replayHash, buffer, n);
+         } else if (n == 0) {
+            break;    // end of file - all done
+         } else if (errno != EAGAIN) {
+            FAIL (isShutdown ? "recv" : "recv (sending)", errno);
+            break;
+         }
+      }
+   }
+
+   #undef DUE
+   #undef FAIL
+
+   session->replayLatency = timeNow () - t0;
+   session->isReplayed = isOkay;
+   close (fd);
+}
+
+//------------------------------------------------------------------------------
+//
+static void* threadMain (void* arg)
+{
+   Session* session = (Session*) arg;
+   char* buffer = (char*) malloc (BUFFER_SIZE);
+
+   replaySession (session, buffer);
+   free (buffer);
+
+   pthread_mutex_lock (&slotMutex);
+   numberRunning--;
+   pthread_cond_signal (&slotCondition);
+   pthread_mutex_unlock (&slotMutex);
+   return NULL;
+}
+
+//------------------------------------------------------------------------------
+//
+static int compareSessions (const void* a, const void* b)
+{
+   const double x = ((const Session*) a)->startTime;
+   const double y = ((const Session*) b)->startTime;
+   return (x < y) ? -1 : (x > y) ? +1 : 0;
+}
+
+//------------------------------------------------------------------------------
+//
+static int compareDoubles (const void* a, const void* b)
+{
+   const double x = *(const double*) a;
+   const double y = *(const double*) b;
+   return (x < y) ? -1 : (x > y) ? +1 : 0;
+}
+
+//------------------------------------------------------------------------------
+//
+int main (int argc, char** argv)
+{
+   while (true) {
+      int option_index = 0;
+
+      static const struct option long_options[] = {
+         {"help", no_argument, NULL, 'h'},
+         {"speed", required_argument, NULL, 'x'},
+         {"service", required_argument, NULL, 'S'},
+         {"concurrency", required_argument, NULL, 'c'},
+         {"max-slowdown", required_argument, NULL, 'm'},
+         {"verbose", no_argument, NULL, 'v'},
+         {NULL, 0, NULL, 0}
+      };
+
+      const int c = getopt_long (argc, argv, "hx:S:c:m:v", long_options, &option_index);
+      if (c == -1)
+         break;
+
+      switch (c) {
+         case 'h':
+            printUsage (stdout);
+            return 0;
+
+         case 'x':
+            speed = atof (optarg);
+            break;
+
+         case 'S':
+            serviceName = optarg;
+            break;
+
+         case 'c':
+            maximumConcurrent = atoi (optarg);
+            break;
+
+         case 'm':
+            maximumSlowdown = atof (optarg);
+            break;
+
+         case 'v':
+            isVerbose = true;
+            break;
+
+         default:
+            printUsage (stderr);
+            return 1;
+      }
+   }
+
+   const int numberArgs = argc - optind;
+   if (numberArgs == 2) {
+      port = argv [optind + 1];
+   } else if (numberArgs == 3) {
+      host = argv [optind + 1];
+      port = argv [optind + 2];
+   } else {
+      printUsage (stderr);
+      return 1;
+   }
+   const char* filename = argv [optind];
+
+   if (speed < 0.0) speed = 0.0;
+
+   // The session latency includes the time taken by the client to send the
+   // input, so only a replay at the captured pace is comparable.
+   //
+   if ((maximumSlowdown > 0.0) && (speed != 1.0)) {
+      fprintf (stderr, "--max-slowdown requires a speed of 1\n");
+      return 1;
+   }
+   if (maximumConcurrent < 1) maximumConcurrent = 1;
+
+   struct addrinfo hints;
+   memset (&hints, 0, sizeof (hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   const int status = getaddrinfo (host, port, &hints, &serverAddress);
+   if (status != 0) {
+      fprintf (stderr, "getaddrinfo (%s, %s): %s\n", host, port, gai_strerror (status));
+      return 2;
+   }
+
+   if (!loadCapture (filename)) {
+      return 2;
+   }
+
+   // Select the sessions to replay, in arrival order.
+   //
+   int number = 0;
+   for (int j = 0; j < numberSessions; j++) {
+      if (serviceName && (strcmp (sessions [j].service, serviceName) != 0)) continue;
+      sessions [number++] = sessions [j];
+   }
+   numberSessions = number;
+   qsort (sessions, numberSessions, sizeof (Session), compareSessions);
+
+   if (numberSessions == 0) {
+      fprintf (stderr, "no sessions to replay\n");
+      return 2;
+   }
+
+   // Start each session at its captured arrival time (scaled by speed),
+   // subject to the concurrency limit.
+   //
+   pthread_t* threads = (pthread_t*) malloc (sizeof (pthread_t) * numberSessions);
+   const double startTime = timeNow ();
+   const double firstArrival = sessions [0].startTime;
+
+   for (int j = 0; j < numberSessions; j++) {
+      if (speed > 0.0) {
+         sleepUntil (startTime + (sessions [j].startTime - firstArrival) / speed);
+      }
+
+      pthread_mutex_lock (&slotMutex);
+      while (numberRunning >= maximumConcurrent) {
+         pthread_cond_wait (&slotCondition, &slotMutex);
+      }
+      numberRunning++;
+      pthread_mutex_unlock (&slotMutex);
+
+      pthread_create (&threads [j], NULL, threadMain, &sessions [j]);
+   }
+   for (int j = 0; j < numberSessions; j++) {
+      pthread_join (threads [j], NULL);
+   }
+   const double elapsed = timeNow () - startTime;
+
+   // Compare the results.
+   //
+   int numberFailed = 0;
+   int numberMatched = 0;
+   int numberDiffered = 0;
+   int numberUnknown = 0;
+   int numberLatencies = 0;
+   double* captured = (double*) malloc (sizeof (double) * numberSessions);
+   double* replayed = (double*) malloc (sizeof (double) * numberSessions);
+
+   for (int j = 0; j < numberSessions; j++) {
+      const Session* session = &sessions [j];
+      const char* outcome;
+      char failure [120];
+
+      if (!session->isReplayed) {
+         numberFailed++;
+         if (session->failureErrno) {
+            snprintf (failure, sizeof (failure), "FAILED: %s: %s",
+                      session->failure, strerror (session->failureErrno));
+         } else {
+            snprintf (failure, sizeof (failure), "FAILED: %s", session->failure);
+         }
+         outcome = failure;
+      } else if (!session->hasEnd) {
+         numberUnknown++;
+         outcome = "no captured output";
+      } else if ((session->replayLength == session->outputLength) &&
+                 (session->replayHash == session->outputHash)) {
+         numberMatched++;
+         outcome = "output matches";
+         captured [numberLatencies] = session->endOffset;
+         replayed [numberLatencies] = session->replayLatency;
+         numberLatencies++;
+      } else {
+         numberDiffered++;
+         outcome = "OUTPUT DIFFERS";
+      }
+
+      if (isVerbose || ((outcome [0] >= 'A') && (outcome [0] <= 'Z'))) {
+         fprintf (stdout, "session %d/%u %s %s: %zu bytes in, %llu/%llu bytes out, "
+                  "%.3f/%.3f ms - %s\n",
+                  int (session->id >> 32), unsigned (session->id & 0xFFFFFFFF),
+                  session->service [0] ? session->service : "-", session->client,
+                  session->dataLength,
+                  (unsigned long long) session->outputLength,
+                  (unsigned long long) session->replayLength,
+                  1000.0 * session->endOffset, 1000.0 * session->replayLatency, outcome);
+      }
+   }
+
+   qsort (captured, numberLatencies, sizeof (double), compareDoubles);
+   qsort (replayed, numberLatencies, sizeof (double), compareDoubles);
+
+   #define PERCENTILE(a,p) (numberLatencies > 0 ? 1000.0 * a [int ((p) * (numberLatencies - 1))] : 0.0)
+
+   fprintf (stdout, "sessions:     %d replayed in %.3f s, %d failed\n",
+            numberSessions, elapsed, numberFailed);
+   fprintf (stdout, "output:       %d match, %d differ, %d not captured\n",
+            numberMatched, numberDiffered, numberUnknown);
+   fprintf (stdout, "captured (ms): p50 %.3f  p99 %.3f  max %.3f\n",
+            PERCENTILE (captured, 0.50), PERCENTILE (captured, 0.99), PERCENTILE (captured, 1.0));
+   fprintf (stdout, "replayed (ms): p50 %.3f  p99 %.3f  max %.3f\n",
+            PERCENTILE (replayed, 0.50), PERCENTILE (replayed, 0.99), PERCENTILE (replayed, 1.0));
+   if (speed != 1.0) {
+      fprintf (stdout, "note:         input paced at speed %g, so the latencies are not comparable\n",
+               speed);
+   }
+
+   int result = (numberFailed > 0) || (numberDiffered > 0) ? 3 : 0;
+
+   if ((maximumSlowdown > 0.0) && (numberLatencies > 0)) {
+      const double ratio = PERCENTILE (replayed, 0.50) / PERCENTILE (captured, 0.50);
+      fprintf (stdout, "slowdown:     %.3f (limit %.3f)%s\n", ratio, maximumSlowdown,
+               ratio > maximumSlowdown ? " - REGRESSION" : "");
+      if ((ratio > maximumSlowdown) && (result == 0)) result = 4;
+   }
+
+   #undef PERCENTILE
+
+   freeaddrinfo (serverAddress);
+   return result;
+}
+
+// end
@@ -30,11 +30,24 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <signal.h>
+#include <stdint.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "utilities.h"
 #include "listener_socket.h"
+#include "cgroup.h"
+#include "adaptive_limit.h"
+#include "probes.h"
+#include "reload.h"
+#include "service_config.h"
+#include "proxy.h"
+#include "submit.h"
+#include "tls_session.h"
+#include "capture.h"
 
 #define MAXIMUM_CONNECTIONS   100
 #define VERSION_STRING        "1.2.2"
@@ -47,6 +60,8 @@ static void printUsage (FILE * stream)
    const char* const message =
          "\n"
          "usage: filter_server [OPTIONS] port command args...\n"
+         "       filter_server [OPTIONS] --config file\n"
+         "       filter_server [OPTIONS] --proxy host:port,... port\n"
          "       filter_server [--help|-h]\n"
          "       filter_server [--version|-v]\n"
          "\n";
@@ -71,12 +86,180 @@ static void printHelp ()
          "               This will be clamped to the range 1 to %d\n"
          "               The default is 20 sessions.\n"
          "\n"
+         "--adaptive, -a Adapt the session limit at run time, between 1 and the maximum\n"
+         "               number of sessions, based on the run queue length, memory\n"
+         "               pressure (PSI) and the session latency. The limit is increased\n"
+         "               by one per second while connections are waiting and the host\n"
+         "               is not overloaded, and decreased by 25%% when overloaded.\n"
+         "\n"
          "--timeout, -t  The maximum time in seconds that a session is allowed to run for.\n"
          "               It may be qualified with m, h, d or w for minutes, hours, days\n"
          "               and weeks respectively.\n"
          "               The timeout will be adjusted to be >= 1.0 seconds if needs be.\n"
          "               The default is no timeout applied to a session.\n"
          "\n"
+         "--idle, -i     The maximum time in seconds that a session may be idle, i.e. no\n"
+         "               bytes received from or sent to the client. Qualifiers as per\n"
+         "               timeout. The default is no idle timeout. This and --min-rate\n"
+         "               only apply to TCP services.\n"
+         "\n"
+         "--min-rate, -r The minimum throughput a session must maintain, in the form\n"
+         "               rate[:period], where rate is bytes/second (optionally qualified\n"
+         "               with k or M) and period is the measurement period (qualifiers\n"
+         "               as per timeout, default 60 seconds). A session moving fewer\n"
+         "               than rate x period bytes in any one period is terminated.\n"
+         "               The default is no minimum throughput.\n"
+         "\n"
+         "--session-rate, -b\n"
+         "               The maximum bandwidth, in bytes/second, allowed for each\n"
+         "               session. May be qualified with k, M or G.\n"
+         "\n"
+         "--client-rate, -c\n"
+         "               The maximum bandwidth, in bytes/second, allowed for all the\n"
+         "               sessions from any one client address. This is shared equally\n"
+         "               between that client's active sessions.\n"
+         "\n"
+         "--total-rate, -g\n"
+         "               The maximum bandwidth, in bytes/second, allowed for all the\n"
+         "               sessions. This is shared equally between all active sessions,\n"
+         "               i.e. those that moved data in the last check period or are\n"
+         "               paused awaiting bandwidth.\n"
+         "\n"
+         "               Bandwidth is measured on the client connection (both directions)\n"
+         "               and is enforced by pausing a session that has exceeded its token\n"
+         "               bucket allowance until sufficient tokens have accrued.\n"
+         "               The default is no bandwidth limit.\n"
+         "\n"
+         "--cgroup, -G   Place each session in its own cgroup v2, created under the\n"
+         "               specified (delegated) cgroup directory, and report each\n"
+         "               session's peak memory and CPU usage on completion.\n"
+         "\n"
+         "--memory-max, -M\n"
+         "               Session cgroup memory.max limit in bytes (may be qualified\n"
+         "               with k, M or G). Requires --cgroup.\n"
+         "\n"
+         "--cpu-max, -U  Session cgroup cpu.max limit expressed as a number of CPUs,\n"
+         "               e.g. 0.5 or 2. Requires --cgroup.\n"
+         "\n"
+         "--pids-max, -P Session cgroup pids.max limit. Requires --cgroup.\n"
+         "\n"
+         "--pin, -p      Pin each session's processes, i.e. the filter and any pre/post\n"
+         "               processes, to a single 'core' or NUMA 'node'. When pinned to a\n"
+         "               node, memory is preferentially allocated from that node.\n"
+         "               The default is 'none'.\n"
+         "\n"
+         "--placement, -L\n"
+         "               How a core/node is chosen for each new session: 'rr' round\n"
+         "               robin or 'least' the core/node with fewest sessions.\n"
+         "               The default is 'rr'.\n"
+         "\n"
+         "--nice, -n     The nice value applied to session processes.\n"
+         "\n"
+         "--policy, -S   The scheduling policy applied to session processes: 'other',\n"
+         "               'batch' or 'idle'.\n"
+         "\n"
+         "--ioprio, -I   The I/O priority applied to session processes: 'be[:level]',\n"
+         "               'idle' or 'rt[:level]', level is 0 (highest) to 7 (lowest).\n"
+         "\n"
+         "--trace-phases, -T\n"
+         "               Report each session's phase timeline, i.e. the estimated time\n"
+         "               waiting to be accepted, the time taken by the fork, closing\n"
+         "               inherited file descriptors, creating the gunzip/gzip processes\n"
+         "               and the exec, and the total session time. The exec time is\n"
+         "               measured by a short lived watcher process (one extra process\n"
+         "               per session, reparented away from the filter so that it\n"
+         "               does not remain as a zombie).\n"
+         "               The same phases are also available as USDT probes (provider\n"
+         "               filter_server) for use with perf and bpftrace.\n"
+         "\n"
+         "--reload-file, -R\n"
+         "               On receipt of SIGHUP, the server starts a successor process\n"
+         "               running the (possibly upgraded) filter_server executable, and\n"
+         "               hands over the listening socket. Once the successor is ready,\n"
+         "               this server stops accepting connections and exits when its\n"
+         "               existing sessions are complete. The successor's arguments are\n"
+         "               read from this file, one argument per line, if it exists,\n"
+         "               otherwise the current arguments are re-used.\n"
+         "               Note: the successor's session limit does not take account\n"
+         "               of sessions still draining from the old server.\n"
+         "\n"
+         "--config, -f   Read the services from the specified configuration file rather\n"
+         "               than the port and command parameters. One server then hosts\n"
+         "               all the services, drawing on a common session budget as\n"
+         "               specified by --sessions. See README.md for the file format.\n"
+         "               The --timeout, --idle, --min-rate, --unzip and --zip options\n"
+         "               provide the default settings for each service.\n"
+         "\n"
+         "--proxy, -x    Forward each connection to one of the specified backend\n"
+         "               filter_server instances, a comma separated list of host:port,\n"
+         "               rather than running a command. Data is relayed using splice.\n"
+         "               Idle backends are checked every 30 seconds. A backend is\n"
+         "               removed after 2 consecutive failed checks or a failed session\n"
+         "               connect (the session then tries another backend), until the\n"
+         "               next successful check, made every 2 seconds.\n"
+         "\n"
+         "--balance, -B  How a backend is chosen for each connection: 'least' the\n"
+         "               backend with fewest sessions, or 'hash' consistent hashing\n"
+         "               of the client's IPv4 address. The default is 'least'.\n"
+         "\n"
+         "--submit, -k   Also accept local job submissions on the specified unix socket\n"
+         "               path. A client (see filter_submit) passes an open input file\n"
+         "               and an open output file or pipe (both required), which are\n"
+         "               connected directly to the filter's standard input and output.\n"
+         "               filter_submit passes its standard output by default, or a pipe\n"
+         "               with --relay.\n"
+         "\n"
+         "--backlog, -l  The listen backlog. The default is 2, which is fine for a\n"
+         "               few clients, but busy services should specify more, e.g. 128,\n"
+         "               as connections dropped from a full backlog are delayed by the\n"
+         "               client's SYN retransmission (1 second or more).\n"
+         "\n"
+         "--defer-accept, -D\n"
+         "               Set TCP_DEFER_ACCEPT on the listener, i.e. a connection is\n"
+         "               only accepted (and a session forked) once the client has sent\n"
+         "               some data, or after this many seconds. Not suitable for\n"
+         "               commands that write before reading any input.\n"
+         "\n"
+         "--fastopen, -F Enable TCP fast open on the listener, with the specified\n"
+         "               pending fast open queue length. Requires the server bit (2)\n"
+         "               of net.ipv4.tcp_fastopen to be set.\n"
+         "\n"
+         "--nodelay, -N  Set TCP_NODELAY on each connection, i.e. disable Nagle's\n"
+         "               algorithm so that small writes are sent immediately.\n"
+         "\n"
+         "--cork, -C     Set TCP_CORK on each connection, i.e. only send full\n"
+         "               segments until the session ends (or 200 ms has elapsed).\n"
+         "\n"
+         "--send-buffer, -O\n"
+         "               The SO_SNDBUF size in bytes (may be qualified with k or M).\n"
+         "\n"
+         "--receive-buffer, -E\n"
+         "               The SO_RCVBUF size in bytes (may be qualified with k or M).\n"
+         "\n"
+         "--keepalive, -K\n"
+         "               Enable TCP keep alive on each connection, in the form\n"
+         "               idle[:interval[:count]], idle and interval in seconds.\n"
+         "\n"
+         "--tls-cert, -X Terminate TLS on the TCP service(s) using the specified PEM\n"
+         "               certificate (chain) file. The filter itself sees plain text.\n"
+         "               Clients may resume sessions using session tickets.\n"
+         "\n"
+         "--tls-key, -Y  The PEM private key file. The default is the certificate file.\n"
+         "\n"
+         "--capture, -w  Capture each session's input bytes, arrival times and output\n"
+         "               summary (length and hash) to the specified append-only file,\n"
+         "               for replay by filter_replay. Proxy sessions are not captured.\n"
+         "\n"
+         "--pipeline, -e Treat \"|\" arguments of the command as pipeline stage\n"
+         "               separators, see README. Without this option, \"|\" arguments\n"
+         "               are passed to the command as is.\n"
+         "\n"
+         "--pipe-size, -Z\n"
+         "               The capacity of the pipes between the pipeline stages, and\n"
+         "               the gunzip/gzip processes, in bytes (may be qualified with k\n"
+         "               or M). Limited to /proc/sys/fs/pipe-max-size for non-root\n"
+         "               users. The default is the system default, typically 64k.\n"
+         "\n"
          "--unzip, -u    Decompress the input (using gunzip) sent to the filter command.\n"
          "\n"
          "--zip, -z      Compress output (using gzip) from the filter command.\n"
@@ -93,6 +276,12 @@ static void printHelp ()
          "               using an absolute path.\n"
          "\n"
          "args...        Optional arguments passed to the command executable.\n"
+         "               With --pipeline, a '|' argument (quoted to protect it from the\n"
+         "               shell) separates the stages of a multi-stage pipeline, e.g.\n"
+         "               sort '|' uniq -c.\n"
+         "               The separator may specify the size of the pipe out of the\n"
+         "               preceding stage, e.g. '|1M'. A stage of @relay is an in-server\n"
+         "               relay that copies its input to its output using splice.\n"
          "\n"
          "\n"
          "Example (trivial):\n"
@@ -124,15 +313,217 @@ enum ProcessState {
 
 struct ProcessData {
    pid_t pid;
+   ServiceConfig* service;
    ProcessState state;
+   double startTime;
+   double acceptTime;         // only set if tracing phases, else -1.0
    double expiryTime;
+   const char* reason;        // why the process is being terminated
+
+   // Server observed I/O - only used when idle/throughput/bandwidth rules
+   // are in play.
+   //
+   int connectionFd;          // retained connection socket or -1
+   uint64_t bytesMoved;       // total bytes received plus sent
+   uint64_t newBytes;         // bytes moved since last observation
+   double lastActivityTime;
+   double periodStartTime;
+   uint64_t periodStartBytes;
+
+   // Bandwidth shaping
+   //
+   in_addr_t clientAddress;
+   double tokens;             // token bucket content, in bytes
+   double lastShapeTime;
+   bool isPaused;             // process group stopped awaiting tokens
+
+   // Session cgroup path, empty if none.
+   //
+   char cgroupPath [CGROUP_PATH_SIZE];
+
+   int placementUnit;         // allocated core/node or -1
+   int backend;               // proxy mode backend or -1
+};
+
+// Bandwidth limits, in bytes/second, 0.0 means no limit.
+//
+struct BandwidthLimits {
+   double sessionRate;
+   double clientRate;
+   double totalRate;
 };
 
+// The token bucket holds at most this many seconds worth of tokens,
+// but no less than MINIMUM_BURST bytes.
+//
+#define BURST_TIME            0.1
+#define MINIMUM_BURST         16384.0
+
 typedef struct ProcessData  ProcessList [MAXIMUM_CONNECTIONS];
 
+//------------------------------------------------------------------------------
+// Reads the bytes moved on the retained connection, if any, and updates
+// the process I/O activity data.
+//
+static void observeSessionIO (ProcessData* proc, const double timeNow)
+{
+   proc->newBytes = 0;
+   if (proc->connectionFd < 0) return;
+
+   uint64_t received;
+   uint64_t sent;
+   if (!getConnectionByteCounts (proc->connectionFd, received, sent)) return;
+
+   const uint64_t total = received + sent;
+   if (total != proc->bytesMoved) {
+      proc->newBytes = total - proc->bytesMoved;
+      proc->bytesMoved = total;
+      proc->lastActivityTime = timeNow;
+   }
+
+   // A session paused by bandwidth shaping is not idle as such.
+   //
+   if (proc->isPaused) {
+      proc->lastActivityTime = timeNow;
+   }
+}
+
+//------------------------------------------------------------------------------
+// Checks the I/O observed on the connection against the activity rules.
+// If a rule has been broken, the process is marked as expired.
+//
+static void checkActivity (ProcessData* proc, const double timeNow)
+{
+   if ((proc->connectionFd < 0) || (proc->state != psRunning)) return;
+
+   // A submitted session's I/O does not pass through the connection, and the
+   // byte counts are only available for TCP connections (see
+   // getConnectionByteCounts), so the rules only apply to TCP services.
+   //
+   if (proc->service->isSubmit || (proc->service->port == 0)) return;
+
+   const ActivityRules* rules = &proc->service->activityRules;
+
+   const uint64_t total = proc->bytesMoved;
+
+   if (timeNow >= proc->lastActivityTime + rules->idleTime) {
+      proc->reason = "Idle";
+      proc->expiryTime = timeNow;
+      return;
+   }
+
+   if (rules->minimumRate > 0.0) {
+      const double elapsed = timeNow - proc->periodStartTime;
+      if (elapsed >= rules->ratePeriod) {
+         const double rate = double (total - proc->periodStartBytes) / elapsed;
+         if (rate < rules->minimumRate) {
+            fprintf (stdout, "Process %d throughput %.1f bytes/sec too low\n",
+                     proc->pid, rate);
+            proc->reason = "Throughput";
+            proc->expiryTime = timeNow;
+            return;
+         }
+         proc->periodStartTime = timeNow;
+         proc->periodStartBytes = total;
+      }
+   }
+}
+
+//------------------------------------------------------------------------------
+// Stops or continues the process group of the session process, i.e the filter
+// and any pre/post processes.
+//
+static void pauseProcess (ProcessData* proc, const bool pause)
+{
+   const int signal = pause ? SIGSTOP : SIGCONT;
+   const int status = kill (-proc->pid, signal);
+   if (status < 0) {
+      perrorf ("kill (-%d, %s)", proc->pid, pause ? "SIGSTOP" : "SIGCONT");
+   }
+   proc->isPaused = pause;
+}
+
+//------------------------------------------------------------------------------
+// A session is drawing bandwidth if it moved bytes since the last observation,
+// or is paused awaiting tokens.
+//
+static bool isDrawing (const ProcessData* proc)
+{
+   return (proc->pid >= 0) && (proc->state == psRunning) &&
+          ((proc->newBytes > 0) || proc->isPaused);
+}
+
+//------------------------------------------------------------------------------
+// Token bucket rate limiting. Each session's bucket is refilled at the smallest
+// of the session rate, its share of its client's rate, and its share of the
+// total rate. The client and total rates are shared only among the sessions
+// drawing bandwidth, so idle (e.g. interactive) sessions do not leave their
+// share unused; an idle session is allocated the share it would have if it
+// became active. Sessions that have over drawn their bucket are paused until
+// the bucket has refilled.
+//
+static void shapeBandwidth (ProcessList children, const int maximumSessions,
+                            const BandwidthLimits* limits, const double timeNow)
+{
+   int numberDrawing = 0;
+   for (int j = 0; j < maximumSessions; j++) {
+      if (isDrawing (&children [j])) {
+         numberDrawing++;
+      }
+   }
+
+   for (int j = 0; j < maximumSessions; j++) {
+
+      ProcessData* proc = &children [j];
+      if ((proc->pid < 0) || (proc->state != psRunning)) continue;
+
+      const int self = isDrawing (proc) ? 0 : 1;
+
+      double rate = 1.0E+20;
+      if (limits->sessionRate > 0.0) {
+         rate = limits->sessionRate;
+      }
+
+      if (limits->clientRate > 0.0) {
+         int numberForClient = self;
+         for (int k = 0; k < maximumSessions; k++) {
+            if (isDrawing (&children [k]) &&
+                (children [k].clientAddress == proc->clientAddress)) {
+               numberForClient++;
+            }
+         }
+         const double share = limits->clientRate / numberForClient;
+         if (share < rate) rate = share;
+      }
+
+      if (limits->totalRate > 0.0) {
+         const double share = limits->totalRate / (numberDrawing + self);
+         if (share < rate) rate = share;
+      }
+
+      if (rate >= 1.0E+20) continue;   // no limits applied.
+
+      double burst = rate * BURST_TIME;
+      if (burst < MINIMUM_BURST) burst = MINIMUM_BURST;
+
+      proc->tokens += rate * (timeNow - proc->lastShapeTime);
+      if (proc->tokens > burst) proc->tokens = burst;
+      proc->tokens -= double (proc->newBytes);
+      proc->lastShapeTime = timeNow;
+
+      if ((proc->tokens < 0.0) && !proc->isPaused) {
+         pauseProcess (proc, true);
+      } else if ((proc->tokens >= 0.0) && proc->isPaused) {
+         pauseProcess (proc, false);
+      }
+   }
+}
+
 //------------------------------------------------------------------------------
 //
-static void checkUpOnTheKids (ProcessList children, const int maximumSessions)
+static void checkUpOnTheKids (ProcessList children, const int maximumSessions,
+                              const BandwidthLimits* limits,
+                              AdaptiveLimit* adaptive)
 {
    const double timeNow = getTimeSinceStart ();
 
@@ -157,25 +548,62 @@ static void checkUpOnTheKids (ProcessList children, const int maximumSessions)
              //
              fprintf (stdout, "Process %d is complete, exit code: %d.\n",
                                proc->pid, status >> 8);
+             const double duration = timeNow - proc->startTime;
+             PROBE3 (session_done, proc->pid, status, int64_t (1.0e6 * duration));
+             if (proc->acceptTime >= 0.0) {
+                fprintf (stdout, "Process %d total session time: %.3f ms\n",
+                         proc->pid, 1.0e3 * (timeNow - proc->acceptTime));
+             }
+             if (proc->connectionFd >= 0) {
+                if (proc->service->isSubmit) {
+                   sendSubmissionStatus (proc->connectionFd, status);
+                }
+                close (proc->connectionFd);
+                proc->connectionFd = -1;
+             }
+             if (proc->cgroupPath [0]) {
+                reportSessionCgroup (proc->cgroupPath, proc->pid);
+                removeSessionCgroup (proc->cgroupPath);
+                proc->cgroupPath [0] = '\0';
+             }
+             releasePlacementUnit (proc->placementUnit);
+             proc->placementUnit = -1;
+             if (adaptive) {
+                recordSessionLatency (adaptive, duration);
+             }
+             if (proc->service->proxy) {
+                releaseBackend (proc->service->proxy, proc->backend,
+                                WIFEXITED (status) && (WEXITSTATUS (status) == PROXY_CONNECT_FAILED));
+                proc->backend = -1;
+             }
+             proc->service->numberRunning--;
              proc->pid = -1;   // clear slot
              continue;
          }
 
+         observeSessionIO (proc, timeNow);
+         checkActivity (proc, timeNow);
+
          if (timeNow >= proc->expiryTime) {
 
             switch (proc->state) {
                case psRunning:
-                  fprintf (stdout, "Timeout: terminating process %d\n", proc->pid);
+                  fprintf (stdout, "%s: terminating process %d\n", proc->reason, proc->pid);
                   status = kill (proc->pid, SIGTERM);
                   if (status < 0) {
                      perrorf  ("kill (%d, SIGTERM)", proc->pid);
                   }
+                  if (proc->isPaused) {
+                     // A stopped process will not act on SIGTERM.
+                     //
+                     pauseProcess (proc, false);
+                  }
                   proc->state = psTerminated;
                   break;
 
                case psTerminated:
                   if (timeNow >= proc->expiryTime + 2.0) {
-                     fprintf (stdout, "Timeout: killing process %d\n", proc->pid);
+                     fprintf (stdout, "%s: killing process %d\n", proc->reason, proc->pid);
                      status = kill (proc->pid, SIGKILL);
                      if (status < 0) {
                         perrorf  ("kill (%d, SIGKILL)", proc->pid);
@@ -190,15 +618,38 @@ static void checkUpOnTheKids (ProcessList children, const int maximumSessions)
          }
       }
    }
+
+   shapeBandwidth (children, maximumSessions, limits, timeNow);
+   tidyCgroups ();
 }
 
 //------------------------------------------------------------------------------
-// Find an empty slot if available.
 //
-static int findSlot (const ProcessList children, const int maximumSessions)
+static int numberOfSessions (const ProcessList children, const int maximumSessions)
+{
+   int result = 0;
+
+   for (int j = 0; j < maximumSessions; j++) {
+      if (children [j].pid != -1) {
+         result++;
+      }
+   }
+
+   return result;
+}
+
+//------------------------------------------------------------------------------
+// Find an empty slot if available, and the session limit not reached.
+//
+static int findSlot (const ProcessList children, const int maximumSessions,
+                     const int sessionLimit)
 {
    int result = -1;
 
+   if (numberOfSessions (children, maximumSessions) >= sessionLimit) {
+      return result;
+   }
+
    for (int j = 0; j < maximumSessions; j++) {
       if (children [j].pid == -1) {
          result = j;
@@ -210,6 +661,123 @@ static int findSlot (const ProcessList children, const int maximumSessions)
 }
 
 
+//------------------------------------------------------------------------------
+// Chooses which service with a pending connection, if any, may accept next.
+// A service below its minimum sessions may always accept (subject to the
+// session limit), otherwise sessions reserved for other services are not
+// available. Amongst the eligible services, the one with the smallest number
+// of sessions relative to its weight is chosen, ties are resolved round robin.
+//
+static ServiceConfig* chooseService (ServiceConfig services [], const int numberServices,
+                                     const struct pollfd items [],
+                                     const int numberSessions, const int sessionLimit)
+{
+   static int next = 0;
+
+   if (numberSessions >= sessionLimit) return NULL;
+
+   // Sessions reserved for, but not yet used by, services below their minimum.
+   //
+   int reserved = 0;
+   for (int j = 0; j < numberServices; j++) {
+      const ServiceConfig* service = &services [j];
+      if (service->numberRunning < service->minimumSessions) {
+         reserved += service->minimumSessions - service->numberRunning;
+      }
+   }
+
+   ServiceConfig* best = NULL;
+   bool bestIsReserved = false;
+   double bestShare = 0.0;
+
+   for (int k = 0; k < numberServices; k++) {
+      const int j = (next + k) % numberServices;
+      ServiceConfig* service = &services [j];
+
+      if (!(items [j].revents & POLLIN)) continue;
+      if (service->numberRunning >= service->maximumSessions) continue;
+
+      const bool isReserved = service->numberRunning < service->minimumSessions;
+      if (!isReserved && (numberSessions + reserved >= sessionLimit)) continue;
+
+      const double share = double (service->numberRunning + 1) / service->weight;
+      if (!best || (isReserved && !bestIsReserved) ||
+          ((isReserved == bestIsReserved) && (share < bestShare))) {
+         best = service;
+         bestIsReserved = isReserved;
+         bestShare = share;
+      }
+   }
+
+   if (best) {
+      next = (int (best - services) + 1) % numberServices;
+   }
+   return best;
+}
+
+//------------------------------------------------------------------------------
+// Reports the settings of a service.
+//
+static void reportService (const ServiceConfig* service, const bool isMultiService)
+{
+   if (isMultiService) {
+      fprintf (stdout, "\nservice :          %s\n", service->name);
+   }
+   if (service->port > 0) {
+      fprintf (stdout, "port :             %d\n", service->port);
+   } else {
+      fprintf (stdout, "socket :           %s\n", service->socketPath);
+   }
+   if (isMultiService) {
+      fprintf (stdout, "sessions :         %d to %d, weight %.3g\n",
+               service->minimumSessions, service->maximumSessions, service->weight);
+   }
+
+   const double maximumTime = service->maximumTime;
+   if (maximumTime >= 1.0E+20) {
+      fprintf (stdout, "maximum time :     none\n");
+   } else if (maximumTime >= 86400.0) {
+      fprintf (stdout, "maximum time :     %.5g days\n", maximumTime / 86400.0);
+   } else if (maximumTime >= 3600.0) {
+      fprintf (stdout, "maximum time :     %.5g hours\n", maximumTime / 3600.0);
+   } else {
+      fprintf (stdout, "maximum time :     %.5g seconds\n", maximumTime);
+   }
+
+   const ActivityRules* rules = &service->activityRules;
+   if (rules->idleTime >= 1.0E+20) {
+      fprintf (stdout, "idle time :        none\n");
+   } else {
+      fprintf (stdout, "idle time :        %.5g seconds\n", rules->idleTime);
+   }
+   if (rules->minimumRate > 0.0) {
+      fprintf (stdout, "minimum rate :     %.5g bytes/sec over %.5g seconds\n",
+               rules->minimumRate, rules->ratePeriod);
+   } else {
+      fprintf (stdout, "minimum rate :     none\n");
+   }
+
+   if (service->isSubmit) {
+      fprintf (stdout, "submission :       yes\n");
+   }
+   if (service->isTls) {
+      fprintf (stdout, "tls :              yes\n");
+   }
+   fprintf (stdout, "decompress input : %s\n", service->inputIsCompressed ? "yes" : "no");
+   fprintf (stdout, "compress output :  %s\n", service->doCompressOutput ? "yes" : "no");
+
+   if (service->proxy) {
+      reportBackends (service->proxy);
+      return;
+   }
+
+   fprintf (stdout, "command:           ");
+   for (int j = 0 ; service->argv [j]; j++) {
+      fprintf (stdout, "%s ", service->argv [j]);
+   }
+   fprintf (stdout, "\n");
+}
+
 //------------------------------------------------------------------------------
 //
 int main (int argc, char** argv)
@@ -219,13 +787,33 @@ int main (int argc, char** argv)
    bool inputIsCompressed = false;
    bool doCompressOutput = false;
    int maximumSessions = 20;
+   bool isPipeline = false;
+   double pipeSize = 0.0;
+   const char* proxyList = NULL;
+   const char* submitPath = NULL;
+   const char* captureFile = NULL;
+   const char* tlsCert = NULL;
+   const char* tlsKey = NULL;
+   SocketTuning socketTuning;
+   memset (&socketTuning, 0, sizeof (socketTuning));
+   double bufferSize;
+   BalancePolicy balance = bpLeastConnections;
+   bool isAdaptive = false;
+   bool tracePhases = false;
+   const char* reloadFile = NULL;
+   const char* configFile = NULL;
+   char** originalArgv = argv;
    double maximumTime = 1.0E+20;  //  life of universe plus alot more ;-)
+   ActivityRules activityRules = { 1.0E+20, 0.0, 60.0 };
+   BandwidthLimits bandwidthLimits = { 0.0, 0.0, 0.0 };
+   const char* cgroupParent = NULL;
+   CgroupLimits cgroupLimits = { 0.0, 0.0, 0 };
+   SchedulingSettings scheduling = { puNone, ppRoundRobin, false, 0, -1, 0, 0 };
 
    // Process options
    //
    while (true) {
       int option_index = 0;
-      ssize_t value = 0;
 
       // All long options also have a short option
       //
@@ -235,11 +823,45 @@ int main (int argc, char** argv)
          {"unzip", required_argument, NULL, 'u'},
          {"zip", required_argument, NULL, 'z'},
          {"sessions", required_argument, NULL, 's'},
+         {"adaptive", no_argument, NULL, 'a'},
          {"timeout", required_argument, NULL, 't'},
+         {"idle", required_argument, NULL, 'i'},
+         {"min-rate", required_argument, NULL, 'r'},
+         {"session-rate", required_argument, NULL, 'b'},
+         {"client-rate", required_argument, NULL, 'c'},
+         {"total-rate", required_argument, NULL, 'g'},
+         {"cgroup", required_argument, NULL, 'G'},
+         {"memory-max", required_argument, NULL, 'M'},
+         {"cpu-max", required_argument, NULL, 'U'},
+         {"pids-max", required_argument, NULL, 'P'},
+         {"pin", required_argument, NULL, 'p'},
+         {"placement", required_argument, NULL, 'L'},
+         {"nice", required_argument, NULL, 'n'},
+         {"policy", required_argument, NULL, 'S'},
+         {"ioprio", required_argument, NULL, 'I'},
+         {"trace-phases", no_argument, NULL, 'T'},
+         {"reload-file", required_argument, NULL, 'R'},
+         {"config", required_argument, NULL, 'f'},
+         {"pipeline", no_argument, NULL, 'e'},
+         {"pipe-size", required_argument, NULL, 'Z'},
+         {"proxy", required_argument, NULL, 'x'},
+         {"balance", required_argument, NULL, 'B'},
+         {"submit", required_argument, NULL, 'k'},
+         {"backlog", required_argument, NULL, 'l'},
+         {"defer-accept", required_argument, NULL, 'D'},
+         {"fastopen", required_argument, NULL, 'F'},
+         {"nodelay", no_argument, NULL, 'N'},
+         {"cork", no_argument, NULL, 'C'},
+         {"send-buffer", required_argument, NULL, 'O'},
+         {"receive-buffer", required_argument, NULL, 'E'},
+         {"keepalive", required_argument, NULL, 'K'},
+         {"tls-cert", required_argument, NULL, 'X'},
+         {"tls-key", required_argument, NULL, 'Y'},
+         {"capture", required_argument, NULL, 'w'},
          {NULL, 0, NULL, 0}
       };
 
-      const int c = getopt_long (argc, argv, "hvuzs:t:", long_options, &option_index);
+      const int c = getopt_long (argc, argv, "hvuzs:aTR:f:eZ:x:B:k:l:D:F:NCO:E:K:X:Y:w:t:i:r:b:c:g:G:M:U:P:p:L:n:S:I:", long_options, &option_index);
       if (c == -1)
          break;
 
@@ -275,40 +897,103 @@ int main (int argc, char** argv)
             break;
 
          case 't':
+            if (!parseDuration (optarg, maximumTime)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'i':
+            if (!parseDuration (optarg, activityRules.idleTime)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'r':
             {
-               char xx = ' ';
-               int n = sscanf (optarg, "%ld%c", &value, &xx);
-               if (n < 1) {
-                  // We expect at least one value.
-                  //
+               if (!parseSize (optarg, activityRules.minimumRate)) {
                   printUsage (stderr);
                   return 1;
                }
-
-               if (n == 1) {
-                  // Just treat value as expressed in seconds.
-                  //
-                  maximumTime = double (value);
-                  break;
+               const char* period = strchr (optarg, ':');
+               if (period && !parseDuration (period + 1, activityRules.ratePeriod)) {
+                  printUsage (stderr);
+                  return 1;
                }
+            }
+            break;
 
-               if (n == 2) {
-                  if (xx == ' ') {
-                     maximumTime = double (value);
-                  } else if (xx == 'm') {
-                     maximumTime = 60.0 * double (value);
-                  } else if (xx == 'h') {
-                     maximumTime = 3600.0 * double (value);
-                  } else if (xx == 'd') {
-                     maximumTime = 86400.0 * double (value);
-                  } else if (xx == 'w') {
-                     maximumTime = 604800.0 * double (value);
-                  } else {
-                     fprintf (stderr, "usage - timeout modifier %c\n", xx);
-                     printUsage (stderr);
-                     return 1;
-                  }
-               }
+         case 'b':
+            if (!parseSize (optarg, bandwidthLimits.sessionRate)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'c':
+            if (!parseSize (optarg, bandwidthLimits.clientRate)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'g':
+            if (!parseSize (optarg, bandwidthLimits.totalRate)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'G':
+            cgroupParent = optarg;
+            break;
+
+         case 'M':
+            if (!parseSize (optarg, cgroupLimits.memoryMax)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'U':
+            cgroupLimits.cpuMax = atof (optarg);
+            break;
+
+         case 'P':
+            cgroupLimits.pidsMax = atoi (optarg);
+            break;
+
+         case 'p':
+            if (!parsePinUnit (optarg, scheduling.pinUnit)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'L':
+            if (!parsePlacementPolicy (optarg, scheduling.placement)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'n':
+            scheduling.setNice = true;
+            scheduling.nice = atoi (optarg);
+            break;
+
+         case 'S':
+            if (!parseSchedulingPolicy (optarg, scheduling.policy)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'I':
+            if (!parseIoPriority (optarg, scheduling.ioprioClass, scheduling.ioprioLevel)) {
+               printUsage (stderr);
+               return 1;
             }
             break;
 
@@ -316,6 +1001,103 @@ int main (int argc, char** argv)
             maximumSessions = atoi (optarg);
             break;
 
+         case 'a':
+            isAdaptive = true;
+            break;
+
+         case 'T':
+            tracePhases = true;
+            break;
+
+         case 'R':
+            reloadFile = optarg;
+            break;
+
+         case 'f':
+            configFile = optarg;
+            break;
+
+         case 'e':
+            isPipeline = true;
+            break;
+
+         case 'Z':
+            if (!parseSize (optarg, pipeSize)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'x':
+            proxyList = optarg;
+            break;
+
+         case 'B':
+            if (!parseBalancePolicy (optarg, balance)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'k':
+            submitPath = optarg;
+            break;
+
+         case 'l':
+            socketTuning.backlog = atoi (optarg);
+            break;
+
+         case 'D':
+            socketTuning.deferAccept = atoi (optarg);
+            break;
+
+         case 'F':
+            socketTuning.fastOpen = atoi (optarg);
+            break;
+
+         case 'N':
+            socketTuning.noDelay = true;
+            break;
+
+         case 'C':
+            socketTuning.cork = true;
+            break;
+
+         case 'O':
+            if (!parseSize (optarg, bufferSize)) {
+               printUsage (stderr);
+               return 1;
+            }
+            socketTuning.sendBuffer = int (bufferSize);
+            break;
+
+         case 'E':
+            if (!parseSize (optarg, bufferSize)) {
+               printUsage (stderr);
+               return 1;
+            }
+            socketTuning.receiveBuffer = int (bufferSize);
+            break;
+
+         case 'K':
+            if (!parseKeepAlive (optarg, &socketTuning)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'X':
+            tlsCert = optarg;
+            break;
+
+         case 'Y':
+            tlsKey = optarg;
+            break;
+
+         case 'w':
+            captureFile = optarg;
+            break;
+
          case '?':
             // invalid option
             //
@@ -342,96 +1124,417 @@ int main (int argc, char** argv)
       maximumTime = 1.0;
    }
 
-   // Process parameters
+   if (activityRules.idleTime < 1.0) {
+      activityRules.idleTime = 1.0;
+   }
 
-   const int numberArgs = argc - optind;
-   if (numberArgs < 2) {
-      fprintf (stderr, "Too few arguments\n");
-      printUsage (stderr);
+   if (activityRules.ratePeriod < 1.0) {
+      activityRules.ratePeriod = 1.0;
+   }
+
+   if (tlsKey && !tlsCert) {
+      fprintf (stderr, "--tls-key requires --tls-cert\n");
       return 1;
    }
 
-   const int port = atoi (argv [optind++]);
+   if (socketTuning.noDelay && socketTuning.cork) {
+      fprintf (stderr, "--nodelay and --cork are mutually exclusive\n");
+      return 1;
+   }
 
-   // Adjust argc/argv such that it represnts the command and arguments to to tun.
+   if (!cgroupParent && ((cgroupLimits.memoryMax > 0.0) ||
+                         (cgroupLimits.cpuMax > 0.0) ||
+                         (cgroupLimits.pidsMax > 0))) {
+      fprintf (stderr, "cgroup limits require the --cgroup option\n");
+      return 1;
+   }
+
+   // Each connection is owned by a service. Without a configuration file, there
+   // is just the one service defined by the port and command parameters.
+   // The options also provide the defaults for services in the file.
    //
-   argc -= optind;
-   argv += optind;
+   ServiceConfig defaults;
+   memset (&defaults, 0, sizeof (defaults));
+   defaults.inputIsCompressed = inputIsCompressed;
+   defaults.doCompressOutput = doCompressOutput;
+   defaults.isPipeline = isPipeline;
+   defaults.pipeSize = int (pipeSize);
+   defaults.proxyList = NULL;
+   defaults.balance = balance;
+   defaults.proxy = NULL;
+   defaults.maximumTime = maximumTime;
+   defaults.activityRules = activityRules;
+   defaults.minimumSessions = 0;
+   defaults.maximumSessions = maximumSessions;
+   defaults.weight = 1.0;
+   defaults.listenFd = -1;
+   defaults.numberRunning = 0;
+
+   defaults.isSubmit = false;
+   defaults.isTls = (tlsCert != NULL);
+
+   static ServiceConfig services [MAXIMUM_SERVICES];
+   int numberServices = 0;
 
-   // Verify sensible port number.
+   // Process parameters
+
+   const int numberArgs = argc - optind;
+   if (configFile) {
+      if ((numberArgs > 0) || proxyList || submitPath) {
+         fprintf (stderr, "Unexpected arguments, --proxy or --submit with --config\n");
+         printUsage (stderr);
+         return 1;
+      }
+
+      numberServices = readServiceConfig (configFile, &defaults,
+                                          services, MAXIMUM_SERVICES);
+      if (numberServices < 0) {
+         // readServiceConfig does all the error reporting.
+         //
+         return 2;
+      }
+      if (numberServices == 0) {
+         fprintf (stderr, "%s defines no services\n", configFile);
+         return 2;
+      }
+
+   } else if (proxyList) {
+      if ((numberArgs != 1) || submitPath) {
+         fprintf (stderr, "Expecting just the port parameter, and no --submit, with --proxy\n");
+         printUsage (stderr);
+         return 1;
+      }
+
+      const int port = atoi (argv [optind]);
+      if ((port < 1) || (port > 65535)) {
+         fprintf (stderr, "port number must be in range 1 to 65535\n");
+         return 2;
+      }
+
+      ServiceConfig* service = &services [numberServices++];
+      *service = defaults;
+      service->port = port;
+      service->argv [0] = NULL;
+      service->proxyList = proxyList;
+      service->isTls = false;
+      service->proxy = createProxyBackends (proxyList, balance);
+      if (!service->proxy) {
+         // createProxyBackends does the error reporting.
+         //
+         return 2;
+      }
+      setServiceListenerKey (service);
+
+   } else {
+      if (numberArgs < 2) {
+         fprintf (stderr, "Too few arguments\n");
+         printUsage (stderr);
+         return 1;
+      }
+
+      const int port = atoi (argv [optind++]);
+
+      // Adjust argc/argv such that it represnts the command and arguments to to tun.
+      //
+      argc -= optind;
+      argv += optind;
+
+      // Verify sensible port number.
+      //
+      if ((port < 1) || (port > 65535)) {
+         fprintf (stderr, "port number must be in range 1 to 65535\n");
+         return 2;
+      }
+
+      if (strcmp (argv[0], "") == 0) {
+         fprintf (stderr, "command is empty\n");
+         return 2;
+      }
+
+      if (argc > MAXIMUM_COMMAND_ARGS) {
+         fprintf (stderr, "too many command arguments, maximum is %d\n", MAXIMUM_COMMAND_ARGS);
+         return 2;
+      }
+
+      ServiceConfig* service = &services [numberServices++];
+      *service = defaults;
+      service->port = port;
+      for (int j = 0 ; j < argc; j++) {
+         service->argv [j] = argv [j];
+      }
+      service->argv [argc] = NULL;
+
+      if (!buildPipeline (service->argv, service->isPipeline, service->pipeSize,
+                          &service->pipeline)) {
+         // buildPipeline does the error reporting.
+         //
+         return 2;
+      }
+      setServiceListenerKey (service);
+
+      // The submission service runs the same command.
+      //
+      if (submitPath) {
+         if (strlen (submitPath) >= SOCKET_PATH_SIZE) {
+            fprintf (stderr, "submit socket path too long\n");
+            return 2;
+         }
+         snprintf (service->name, sizeof (service->name), "tcp");
+
+         ServiceConfig* submit = &services [numberServices++];
+         *submit = *service;
+         snprintf (submit->name, sizeof (submit->name), "submit");
+         submit->port = 0;
+         snprintf (submit->socketPath, sizeof (submit->socketPath), "%s", submitPath);
+         submit->isSubmit = true;
+         submit->isTls = false;
+         if (!buildPipeline (submit->argv, submit->isPipeline, submit->pipeSize,
+                             &submit->pipeline)) {
+            // buildPipeline does the error reporting.
+            //
+            return 2;
+         }
+         setServiceListenerKey (submit);
+      }
+   }
+
+   for (int j = 0; j < numberServices; j++) {
+      const int port = services [j].port;
+      if ((port > 0) && (port < 1024)) {
+         fprintf (stderr, "warning: port %d requires root priviledge\n", port);
+      }
+   }
+
+   // We only need hang onto the connection sockets if we are going to
+   // observe the session I/O.
    //
-   if ((port < 1) || (port > 65535)) {
-      fprintf (stderr, "port number must be in range 1 to 65535\n");
-      return 2;
+   bool retainConnection = (bandwidthLimits.sessionRate > 0.0) ||
+                           (bandwidthLimits.clientRate > 0.0) ||
+                           (bandwidthLimits.totalRate > 0.0);
+   for (int j = 0; j < numberServices; j++) {
+      const ActivityRules* rules = &services [j].activityRules;
+      if ((rules->idleTime < 1.0E+20) || (rules->minimumRate > 0.0)) {
+         retainConnection = true;
+      }
    }
 
-   if (port < 1024) {
-      fprintf (stderr, "warning: port %d requires root priviledge\n", port);
+   // Create the TLS context before any session is forked, so that all the
+   // sessions share the same session ticket keys.
+   //
+   for (int j = 0; j < numberServices; j++) {
+      if (services [j].isTls && !tlsCert) {
+         fprintf (stderr, "service %s: tls requires --tls-cert\n", services [j].name);
+         return 2;
+      }
+   }
+   if (tlsCert && !initialiseTls (tlsCert, tlsKey)) {
+      // initialiseTls does all the error reporting.
+      //
+      return 2;
    }
 
-   if (strcmp (argv[0], "") == 0) {
-      fprintf (stderr, "command is empty\n");
+   if (captureFile && !openCaptureFile (captureFile)) {
+      // openCaptureFile does all the error reporting.
+      //
       return 2;
    }
 
    // Report settings
    //
-   fprintf (stdout, "port :             %d\n", port);
    fprintf (stdout, "maximum sessions : %d\n", maximumSessions);
-   if (maximumTime >= 1.0E+20) {
-      fprintf (stdout, "maximum time :     none\n");
-   } else if (maximumTime >= 86400.0) {
-      fprintf (stdout, "maximum time :     %.5g days\n", maximumTime / 86400.0);
-   } else if (maximumTime >= 3600.0) {
-      fprintf (stdout, "maximum time :     %.5g hours\n", maximumTime / 3600.0);
-   } else {
-      fprintf (stdout, "maximum time :     %.5g seconds\n", maximumTime);
+   fprintf (stdout, "adaptive limit :   %s\n", isAdaptive ? "yes" : "no");
+   if (bandwidthLimits.sessionRate > 0.0) {
+      fprintf (stdout, "session rate :     %.5g bytes/sec\n", bandwidthLimits.sessionRate);
+   }
+   if (bandwidthLimits.clientRate > 0.0) {
+      fprintf (stdout, "client rate :      %.5g bytes/sec\n", bandwidthLimits.clientRate);
+   }
+   if (bandwidthLimits.totalRate > 0.0) {
+      fprintf (stdout, "total rate :       %.5g bytes/sec\n", bandwidthLimits.totalRate);
+   }
+   if (cgroupParent) {
+      fprintf (stdout, "cgroup :           %s\n", cgroupParent);
+      if (cgroupLimits.memoryMax > 0.0) {
+         fprintf (stdout, "memory max :       %.5g bytes\n", cgroupLimits.memoryMax);
+      }
+      if (cgroupLimits.cpuMax > 0.0) {
+         fprintf (stdout, "cpu max :          %.5g cpus\n", cgroupLimits.cpuMax);
+      }
+      if (cgroupLimits.pidsMax > 0) {
+         fprintf (stdout, "pids max :         %d\n", cgroupLimits.pidsMax);
+      }
+   }
+   if (captureFile) {
+      fprintf (stdout, "capture file :     %s\n", captureFile);
+   }
+   if (socketTuning.backlog > 0) {
+      fprintf (stdout, "backlog :          %d\n", socketTuning.backlog);
+   }
+   if (socketTuning.deferAccept > 0) {
+      fprintf (stdout, "defer accept :     %d seconds\n", socketTuning.deferAccept);
+   }
+   if (socketTuning.fastOpen > 0) {
+      fprintf (stdout, "fast open queue :  %d\n", socketTuning.fastOpen);
+   }
+   if (socketTuning.noDelay || socketTuning.cork) {
+      fprintf (stdout, "connections :      %s\n", socketTuning.noDelay ? "nodelay" : "cork");
+   }
+   if ((socketTuning.sendBuffer > 0) || (socketTuning.receiveBuffer > 0)) {
+      fprintf (stdout, "socket buffers :   send %d, receive %d bytes\n",
+               socketTuning.sendBuffer, socketTuning.receiveBuffer);
+   }
+   if (socketTuning.keepAliveIdle > 0) {
+      fprintf (stdout, "keep alive :       %d:%d:%d\n", socketTuning.keepAliveIdle,
+               socketTuning.keepAliveInterval, socketTuning.keepAliveCount);
+   }
+   if (scheduling.pinUnit != puNone) {
+      const int numberUnits = initialiseScheduling (&scheduling);
+      fprintf (stdout, "pin sessions to :  %d %s%s (%s)\n", numberUnits,
+               scheduling.pinUnit == puNode ? "node" : "core",
+               numberUnits == 1 ? "" : "s",
+               scheduling.placement == ppLeastLoaded ? "least loaded" : "round robin");
    }
-   fprintf (stdout, "decompress input : %s\n", inputIsCompressed ? "yes" : "no");
-   fprintf (stdout, "compress output :  %s\n", doCompressOutput ? "yes" : "no");
-
 
-   fprintf (stdout, "command:           ");
-   for (int j = 0 ; j < argc; j++) {
-      fprintf (stdout, "%s ", argv[j]);
+   for (int j = 0; j < numberServices; j++) {
+      reportService (&services [j], (configFile != NULL) || (numberServices > 1));
    }
-   fprintf (stdout, "\n");
 
 
    ProcessList childProcessList;
    for (int j = 0; j < MAXIMUM_CONNECTIONS; j++) {
       ProcessData* proc = &childProcessList [j];
       proc->pid = -1;
+      proc->service = NULL;
+      proc->connectionFd = -1;
+      proc->cgroupPath [0] = '\0';
+      proc->placementUnit = -1;
+      proc->backend = -1;
    }
 
-   // construct lister socket bound to the specified port.
-   //
-   int listenFd = createListener (port);
-   if (listenFd < 0) {
-      // createListener does all the perror stuff required.
+   if (cgroupParent && !initialiseCgroups (cgroupParent, &cgroupLimits)) {
+      // initialiseCgroups does all the error reporting.
       //
       return 4;
    }
+   int sessionNumber = 0;
+   const pid_t serverPid = getpid ();
 
-   setNonBlocking (listenFd);
+   AdaptiveLimit adaptiveLimit;
+   initialiseAdaptiveLimit (&adaptiveLimit, maximumSessions, getTimeSinceStart ());
+   AdaptiveLimit* adaptive = isAdaptive ? &adaptiveLimit : NULL;
+   int sessionLimit = maximumSessions;
+
+   // Use the listener sockets handed over by our predecessor if available,
+   // otherwise construct lister sockets bound to the specified port/path.
+   //
+   int listenFds [MAXIMUM_SERVICES];
+   const char* listenerKeys [MAXIMUM_SERVICES];
+   struct pollfd pollItems [MAXIMUM_SERVICES];
+
+   for (int j = 0; j < numberServices; j++) {
+      ServiceConfig* service = &services [j];
+      service->listenFd = inheritListener (service->listenerKey);
+   }
+   closeUnusedListeners ();
+
+   for (int j = 0; j < numberServices; j++) {
+      ServiceConfig* service = &services [j];
+      if (service->listenFd < 0) {
+         if (service->port > 0) {
+            service->listenFd = createListener (service->port);
+         } else {
+            service->listenFd = createUnixListener (service->socketPath);
+         }
+      }
+
+      if (service->listenFd < 0) {
+         // createListener does all the perror stuff required.
+         //
+         return 4;
+      }
 
-   fprintf (stdout, "%s %d waiting for connections.\n", ownHostname (), port);
+      applyListenerTuning (service->listenFd, &socketTuning, service->port > 0);
+      setNonBlocking (service->listenFd);
+      listenFds [j] = service->listenFd;
+      listenerKeys [j] = service->listenerKey;
+
+      if (service->port > 0) {
+         fprintf (stdout, "%s %d waiting for connections.\n", ownHostname (), service->port);
+      } else {
+         fprintf (stdout, "%s %s waiting for connections.\n", ownHostname (), service->socketPath);
+      }
+   }
+
+   initialiseReload (originalArgv, reloadFile);
+   notifyPredecessor ();
+
+   pid_t successorPid = -1;
+   int readyFd = -1;
+   bool isDraining = false;
 
    while (true) {
       struct sockaddr_storage address;
       struct sockaddr* pAddress = (struct sockaddr *) &address;
-      socklen_t size;
+      socklen_t size = sizeof (address);
 
       // Mange current child processes if any.
       // wait pid nohang the child processes.
       // terminate if timeout exceeded.
       //
-      checkUpOnTheKids (childProcessList, maximumSessions);
+      checkUpOnTheKids (childProcessList, maximumSessions,
+                        &bandwidthLimits, adaptive);
+
+      for (int j = 0; j < numberServices; j++) {
+         if (services [j].proxy) {
+            checkBackends (services [j].proxy, getTimeSinceStart ());
+         }
+      }
+
+      // Handle reload/upgrade requests.
+      //
+      if (isReloadRequested () && (successorPid < 0) && !isDraining) {
+         fflush (stdout);
+         successorPid = startSuccessor (listenFds, listenerKeys, numberServices, readyFd);
+      }
+
+      if (successorPid > 0 && !isDraining) {
+         const int news = checkSuccessor (successorPid, readyFd);
+         if (news > 0) {
+            // Our successor is now accepting connections on the same listening
+            // sockets, so we can let go of them.
+            //
+            fprintf (stdout, "Successor %d ready - draining.\n", successorPid);
+            for (int j = 0; j < numberServices; j++) {
+               close (services [j].listenFd);
+               services [j].listenFd = -1;
+            }
+            isDraining = true;
+         } else if (news < 0) {
+            successorPid = -1;
+         }
+      }
+
+      if (isDraining) {
+         const int number = numberOfSessions (childProcessList, maximumSessions);
+         if (number == 0) break;
+         delay (0.005);
+         continue;
+      }
 
       // Check max connections
       //
-      const int slot = findSlot (childProcessList, maximumSessions);
-      if (slot < 0) {
+      const int numberSessions = numberOfSessions (childProcessList, maximumSessions);
+      if (adaptive) {
+         bool isPending = false;
+         if (numberSessions >= sessionLimit) {
+            for (int j = 0; j < numberServices; j++) {
+               if (isReadable (services [j].listenFd)) isPending = true;
+            }
+         }
+         sessionLimit = updateAdaptiveLimit (adaptive, isPending, getTimeSinceStart ());
+      }
+
+      if (numberSessions >= sessionLimit) {
          // Too busy to accept any more connections for now.
          // Sleep a bit and try again
          //
@@ -439,70 +1542,282 @@ int main (int argc, char** argv)
          continue;
       }
 
+      // Wait a bit for connections on any of the services that are able
+      // to accept another session.
+      //
+      for (int j = 0; j < numberServices; j++) {
+         const ServiceConfig* service = &services [j];
+         pollItems [j].fd = (service->numberRunning < service->maximumSessions) ?
+                            service->listenFd : -1;
+         pollItems [j].events = POLLIN;
+         pollItems [j].revents = 0;
+      }
+
+      const int status = poll (pollItems, numberServices, 5);
+      if (status < 0) {
+         if (errno != EINTR) {
+            perrorf ("poll (...)");
+            delay (0.005);
+         }
+         continue;
+      }
+
+      if (status == 0) {
+         continue;   // Nothing pending
+      }
+
+      ServiceConfig* service = chooseService (services, numberServices, pollItems,
+                                              numberSessions, sessionLimit);
+      const int slot = findSlot (childProcessList, maximumSessions, sessionLimit);
+      if (!service || (slot < 0)) {
+         // Pending connections are for services that must wait for now.
+         //
+         delay (0.005);
+         continue;
+      }
+
+      const int listenFd = service->listenFd;
       int connectionFd = accept (listenFd, pAddress, &size);
       if (connectionFd < 0) {
          // We are none blocking - check not "real" errors.
          //
          if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
             perrorf ("accept (%d, ...)", listenFd);
+            delay (0.005);
          }
-
-         // Sleep a bit and try again
-         //
-         delay (0.005);
          continue;
       }
 
-      // OCTET applies required offset and converts signed char to unsigned value.
+      const in_addr_t clientAddress = (pAddress->sa_family == AF_INET) ?
+            ((struct sockaddr_in*) pAddress)->sin_addr.s_addr : 0;
+
+      const double acceptWallTime = captureFile ? captureTimeNow () : 0.0;
+
+      PhaseTimeline timeline;
+      if (tracePhases) {
+         timeline.acceptTime = getTimeSinceStart ();
+      }
+
+      // The accept wait is a single getsockopt, negligible compared to the fork.
       //
-      #define OCTET(n) int (pAddress->sa_data[(n)+1] >= 0 ?             \
-                            pAddress->sa_data[(n)+1] :                  \
-                            pAddress->sa_data[(n)+1] + 256)
+      double acceptWait = -1.0;
+      if ((pAddress->sa_family == AF_INET) || (pAddress->sa_family == AF_INET6)) {
+         getAcceptWait (connectionFd, acceptWait);
+      }
+      timeline.acceptWait = acceptWait;
+      PROBE3 (accept, connectionFd, clientAddress, int64_t (1.0e6 * acceptWait));
 
+      if (pAddress->sa_family == AF_INET) {
+         // OCTET applies required offset and converts signed char to unsigned value.
+         //
+         #define OCTET(n) int (pAddress->sa_data[(n)+1] >= 0 ?             \
+                               pAddress->sa_data[(n)+1] :                  \
+                               pAddress->sa_data[(n)+1] + 256)
 
-      fprintf (stdout, "Accept successful - we have a connection from: %d.%d.%d.%d\n",
-               OCTET(1), OCTET(2), OCTET(3), OCTET(4));
 
-      #undef OCTET
+         fprintf (stdout, "Accept successful - we have a connection from: %d.%d.%d.%d\n",
+                  OCTET(1), OCTET(2), OCTET(3), OCTET(4));
+
+         #undef OCTET
+      } else {
+         fprintf (stdout, "Accept successful - we have a local connection on %s\n",
+                  service->socketPath);
+      }
+
+      // In proxy mode, choose the backend.
+      //
+      ProcessData* proc = &childProcessList [slot];
+      proc->backend = -1;
+      if (service->proxy) {
+         proc->backend = chooseBackend (service->proxy, pAddress);
+         if (proc->backend < 0) {
+            fprintf (stderr, "No healthy backends - rejecting connection\n");
+            close (connectionFd);
+            continue;
+         }
+      }
+
+      // Create the session cgroup, if required, prior to the fork so that the
+      // child can join it before running the filter.
+      //
+      proc->cgroupPath [0] = '\0';
+      sessionNumber++;
+      if (cgroupParent &&
+          !createSessionCgroup (cgroupParent, sessionNumber, &cgroupLimits,
+                                proc->cgroupPath, sizeof (proc->cgroupPath))) {
+         fprintf (stderr, "Unable to create session cgroup - rejecting connection\n");
+         proc->cgroupPath [0] = '\0';
+         if (service->proxy) {
+            releaseBackend (service->proxy, proc->backend, false);
+            proc->backend = -1;
+         }
+         close (connectionFd);
+         continue;
+      }
+
+      // Choose where the session will run, if pinning.
+      //
+      proc->placementUnit = allocatePlacementUnit (&scheduling);
 
       // Use fork to create a child process that will do all the work.
       //
+      PROBE1 (fork_start, slot);
+      if (tracePhases) {
+         timeline.forkTime = getTimeSinceStart ();
+      }
       pid_t pid = fork ();
       if (pid < 0) {
          perrorf ("fork ()");
+         releasePlacementUnit (proc->placementUnit);
+         proc->placementUnit = -1;
+         if (service->proxy) {
+            releaseBackend (service->proxy, proc->backend, false);
+            proc->backend = -1;
+         }
+         if (proc->cgroupPath [0]) {
+            removeSessionCgroup (proc->cgroupPath);
+            proc->cgroupPath [0] = '\0';
+         }
+         close (connectionFd);
          delay (0.005);
          continue;
       }
 
       if (pid > 0) {
          // We are the parent process
-         // Close the incomming socket connection - we leave that to the child.
+         // Close the incomming socket connection - we leave that to the child,
+         // unless we need to keep an eye on the session I/O.
          //
-         close (connectionFd);
+         PROBE1 (fork_done, pid);
+         setpgid (pid, pid);    // avoid race with child, see below.
+
+         // A submission connection is held open until the session is complete,
+         // as this is how the client knows the job is done.
+         //
+         if (!retainConnection && !service->isSubmit) {
+            close (connectionFd);
+            connectionFd = -1;
+         }
 
          // Register child process details.
          //
-         ProcessData* proc = &childProcessList [slot];
+         const double timeNow = getTimeSinceStart ();
          proc->pid = pid;
-         proc->expiryTime = getTimeSinceStart () + maximumTime;
+         proc->startTime = timeNow;
+         proc->acceptTime = tracePhases ? timeline.acceptTime : -1.0;
+         proc->service = service;
+         service->numberRunning++;
+         proc->expiryTime = timeNow + service->maximumTime;
+         proc->reason = "Timeout";
          proc->state = psRunning;
-
-         fprintf (stdout, "Process %s,%d starting.\n", argv[0], pid);
+         proc->connectionFd = connectionFd;
+         proc->bytesMoved = 0;
+         proc->lastActivityTime = timeNow;
+         proc->periodStartTime = timeNow;
+         proc->periodStartBytes = 0;
+         proc->clientAddress = clientAddress;
+         proc->tokens = MINIMUM_BURST;
+         proc->lastShapeTime = timeNow;
+         proc->isPaused = false;
+
+         const char* name = service->proxy ? service->proxy->backends [proc->backend].name
+                                           : service->argv[0];
+         if (proc->placementUnit >= 0) {
+            fprintf (stdout, "Process %s,%d starting on %s.\n", name, pid,
+                     placementUnitImage (&scheduling, proc->placementUnit));
+         } else {
+            fprintf (stdout, "Process %s,%d starting.\n", name, pid);
+         }
 
       } else {
          // We are the child process
-         // Close the listening socket connection - we leave that to the parent.
+         // Close the listening socket connections - we leave that to the parent.
+         //
+         PROBE0 (child_start);
+         if (tracePhases) {
+            timeline.childStartTime = getTimeSinceStart ();
+         }
+         for (int j = 0; j < numberServices; j++) {
+            close (services [j].listenFd);
+         }
+
+         // Form own process group, so that the filter and any pre/post
+         // processes can be paused/continued as a group.
+         //
+         setpgid (0, 0);
+
+         // Join the session cgroup before running anything.
+         //
+         if (proc->cgroupPath [0] && !joinCgroup (proc->cgroupPath)) {
+            _exit (4);
+         }
+
+         // Per connection socket options.
+         //
+         if (service->port > 0) {
+            applyConnectionTuning (connectionFd, &socketTuning);
+         }
+
+         if (service->proxy) {
+            applyScheduling (&scheduling, proc->placementUnit);
+            runProxySession (connectionFd,      // Does not return.
+                             service->proxy,
+                             proc->backend,
+                             pAddress,
+                             service->pipeSize);
+         }
+
+         // Receive the submitted files.
+         //
+         int inputFd = connectionFd;
+         int outputFd = connectionFd;
+         if (service->isSubmit) {
+            if (!receiveSubmission (connectionFd, 5.0, inputFd, outputFd)) {
+               _exit (4);
+            }
+
+         } else if (service->isTls) {
+            // The filter is connected to the TLS relay.
+            //
+            if (!startTlsSession (connectionFd, 10.0, inputFd, outputFd)) {
+               _exit (4);
+            }
+         }
+
+         // Capture the session, if required. The session id is unique across
+         // the server's lifetime.
          //
-         close (listenFd);
+         if (captureFile) {
+            char client [64] = "local";
+            if (pAddress->sa_family == AF_INET) {
+               inet_ntop (AF_INET, &((struct sockaddr_in*) pAddress)->sin_addr,
+                          client, sizeof (client));
+            } else if (pAddress->sa_family == AF_INET6) {
+               inet_ntop (AF_INET6, &((struct sockaddr_in6*) pAddress)->sin6_addr,
+                          client, sizeof (client));
+            }
+            beginCaptureSession ((uint64_t (serverPid) << 32) | uint32_t (sessionNumber),
+                                 acceptWallTime, service->name, client);
+         }
 
-         runChildProcess (connectionFd, argv,   // Does not return.
-                          inputIsCompressed,    //
-                          doCompressOutput);    //
+         runChildProcess (inputFd,              // Does not return.
+                          outputFd,             //
+                          &service->pipeline,   //
+                          service->inputIsCompressed,
+                          service->doCompressOutput,
+                          &scheduling,          //
+                          proc->placementUnit,  //
+                          service->isSubmit ? connectionFd : -1,
+                          tracePhases ? &timeline : NULL);
          return 16;                             // belts 'n' braces
       }
    }
 
-   close (listenFd);
+   for (int j = 0; j < numberServices; j++) {
+      if (services [j].listenFd >= 0) {
+         close (services [j].listenFd);
+      }
+   }
    fprintf (stdout, "filter server complete\n");
    return 0;
 }
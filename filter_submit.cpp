@@ -0,0 +1,205 @@
+// filter_submit.cpp
+//
+// Submits a local job to a filter_server submission socket.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+
+#include "submit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SUBMIT_FAILED         255
+
+//------------------------------------------------------------------------------
+//
+static void printUsage (FILE* stream)
+{
+   fprintf (stream,
+            "\n"
+            "usage: filter_submit [OPTIONS] socket_path\n"
+            "\n"
+            "Passes the input file (default standard input) and the output file\n"
+            "(default standard output) to the filter_server submission socket, and\n"
+            "waits for the job to complete.\n"
+            "\n"
+            "--input, -i    Input file (default standard input).\n"
+            "--output, -o   Output file, created/truncated (default standard output).\n"
+            "--relay, -r    Do not pass the output file, rather pass a pipe and copy\n"
+            "               the filter output from the pipe to the output.\n"
+            "--help, -h     Show this help information and exit.\n"
+            "\n"
+            "The exit status is that of the filter (128 + n if killed by signal n),\n"
+            "or 255 if the job could not be submitted or its status not received.\n"
+            "\n");
+}
+
+//------------------------------------------------------------------------------
+//
+int main (int argc, char** argv)
+{
+   const char* inputName = NULL;
+   const char* outputName = NULL;
+   bool doRelay = false;
+
+   while (true) {
+      static const struct option long_options[] = {
+         {"help", no_argument, NULL, 'h'},
+         {"input", required_argument, NULL, 'i'},
+         {"output", required_argument, NULL, 'o'},
+         {"relay", no_argument, NULL, 'r'},
+         {NULL, 0, NULL, 0}
+      };
+
+      int option_index = 0;
+      const int c = getopt_long (argc, argv, "hi:o:r", long_options, &option_index);
+      if (c == -1)
+         break;
+
+      switch (c) {
+         case 'h':
+            printUsage (stdout);
+            return 0;
+
+         case 'i':
+            inputName = optarg;
+            break;
+
+         case 'o':
+            outputName = optarg;
+            break;
+
+         case 'r':
+            doRelay = true;
+            break;
+
+         default:
+            printUsage (stderr);
+            return 1;
+      }
+   }
+
+   if (argc - optind != 1) {
+      printUsage (stderr);
+      return 1;
+   }
+   const char* socketPath = argv [optind];
+
+   int inputFd = STDIN_FILENO;
+   if (inputName) {
+      inputFd = open (inputName, O_RDONLY);
+      if (inputFd < 0) {
+         perror (inputName);
+         return SUBMIT_FAILED;
+      }
+   }
+
+   int outputFd = STDOUT_FILENO;
+   if (outputName) {
+      outputFd = open (outputName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (outputFd < 0) {
+         perror (outputName);
+         return SUBMIT_FAILED;
+      }
+   }
+
+   // When relaying, the filter writes to a pipe which we copy to the output.
+   //
+   int pipeFds [2] = { -1, -1 };
+   if (doRelay && (pipe (pipeFds) < 0)) {
+      perror ("pipe");
+      return SUBMIT_FAILED;
+   }
+
+   struct sockaddr_un address;
+   memset (&address, 0, sizeof (address));
+   address.sun_family = AF_UNIX;
+   if (strlen (socketPath) >= sizeof (address.sun_path)) {
+      fprintf (stderr, "socket path too long\n");
+      return SUBMIT_FAILED;
+   }
+   strcpy (address.sun_path, socketPath);
+
+   const int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+   if ((fd < 0) || (connect (fd, (struct sockaddr*) &address, sizeof (address)) < 0)) {
+      perror (socketPath);
+      return SUBMIT_FAILED;
+   }
+
+   if (!sendSubmission (fd, inputFd, doRelay ? pipeFds [1] : outputFd)) {
+      return SUBMIT_FAILED;
+   }
+
+   // Our copies of the files are no longer needed, except the output when
+   // relaying. Closing our end of the pipe means we see end of file once
+   // the last writer in the session has finished.
+   //
+   if (inputName) close (inputFd);
+   if (doRelay) {
+      close (pipeFds [1]);
+
+      char buffer [65536];
+      while (true) {
+         const ssize_t n = read (pipeFds [0], buffer, sizeof (buffer));
+         if (n == 0) break;
+         if (n < 0) {
+            if (errno == EINTR) continue;
+            perror ("read");
+            return SUBMIT_FAILED;
+         }
+
+         for (ssize_t done = 0; done < n; ) {
+            const ssize_t m = write (outputFd, buffer + done, n - done);
+            if (m < 0) {
+               if (errno == EINTR) continue;
+               perror ("write");
+               return SUBMIT_FAILED;
+            }
+            done += m;
+         }
+      }
+      close (pipeFds [0]);
+   }
+   if (outputName) close (outputFd);
+
+   // The server sends the filter's exit status, and the connection is closed
+   // once the output is complete.
+   //
+   int exitStatus;
+   if (!receiveSubmissionStatus (fd, exitStatus)) {
+      return SUBMIT_FAILED;
+   }
+   close (fd);
+
+   if (exitStatus != 0) {
+      fprintf (stderr, "filter exit status: %d\n", exitStatus);
+   }
+   return exitStatus >= 0 ? exitStatus : SUBMIT_FAILED;
+}
+
+// end
@@ -25,14 +25,106 @@
 #include "utilities.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <linux/tcp.h>
 
 #define BACKLOG               2
+#define MAXIMUM_INHERITED     100
+
+static int claimedFds [MAXIMUM_INHERITED];
+static int numberClaimed = 0;
+
+//------------------------------------------------------------------------------
+// Sets an integer socket option, reporting any failure.
+//
+static void setOption (const int fd, const int level, const int name,
+                       const char* image, const int value)
+{
+   const int status = setsockopt (fd, level, name, &value, sizeof (value));
+   if (status == -1) {
+      perrorf ("setsockopt (%d, %s, %d)", fd, image, value);
+   }
+}
+
+//------------------------------------------------------------------------------
+//
+bool parseKeepAlive (const char* text, SocketTuning* tuning)
+{
+   int idle = 0;
+   int interval = 0;
+   int count = 0;
+
+   const int number = sscanf (text, "%d:%d:%d", &idle, &interval, &count);
+   if ((number < 1) || (idle < 1) || (interval < 0) || (count < 0)) {
+      fprintf (stderr, "invalid keep alive '%s', expecting idle[:interval[:count]]\n", text);
+      return false;
+   }
+
+   tuning->keepAliveIdle = idle;
+   tuning->keepAliveInterval = interval;
+   tuning->keepAliveCount = count;
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+void applyListenerTuning (const int fd, const SocketTuning* tuning, const bool isTcp)
+{
+   if (tuning->sendBuffer > 0) {
+      setOption (fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", tuning->sendBuffer);
+   }
+   if (tuning->receiveBuffer > 0) {
+      setOption (fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", tuning->receiveBuffer);
+   }
+
+   if (isTcp) {
+      if (tuning->deferAccept > 0) {
+         setOption (fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", tuning->deferAccept);
+      }
+      if (tuning->fastOpen > 0) {
+         setOption (fd, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", tuning->fastOpen);
+      }
+      if (tuning->keepAliveIdle > 0) {
+         setOption (fd, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE", 1);
+         setOption (fd, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE", tuning->keepAliveIdle);
+         if (tuning->keepAliveInterval > 0) {
+            setOption (fd, IPPROTO_TCP, TCP_KEEPINTVL, "TCP_KEEPINTVL", tuning->keepAliveInterval);
+         }
+         if (tuning->keepAliveCount > 0) {
+            setOption (fd, IPPROTO_TCP, TCP_KEEPCNT, "TCP_KEEPCNT", tuning->keepAliveCount);
+         }
+      }
+   }
+
+   // Calling listen again on a listening socket just updates the backlog.
+   //
+   if (tuning->backlog > 0) {
+      const int status = listen (fd, tuning->backlog);
+      if (status == -1) {
+         perrorf ("applyListenerTuning: listen (%d, %d)", fd, tuning->backlog);
+      }
+   }
+}
+
+//------------------------------------------------------------------------------
+//
+void applyConnectionTuning (const int fd, const SocketTuning* tuning)
+{
+   if (tuning->noDelay) {
+      setOption (fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+   }
+   if (tuning->cork) {
+      setOption (fd, IPPROTO_TCP, TCP_CORK, "TCP_CORK", 1);
+   }
+}
 
 //------------------------------------------------------------------------------
 //
@@ -114,6 +206,121 @@ int createListener (const int local_port)
    return fd;
 }
 
+//------------------------------------------------------------------------------
+//
+int createUnixListener (const char* path)
+{
+   struct sockaddr_un address;
+   struct stat info;
+   int status;
+
+   memset (&address, 0, sizeof (address));
+   address.sun_family = AF_UNIX;
+   if (strlen (path) >= sizeof (address.sun_path)) {
+      fprintf (stderr, "createUnixListener: path %s too long\n", path);
+      return -1;
+   }
+   strcpy (address.sun_path, path);
+
+   // Remove any stale socket left by a previous server, but nothing else.
+   //
+   if ((stat (path, &info) == 0) && S_ISSOCK (info.st_mode)) {
+      unlink (path);
+   }
+
+   const int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+   if (fd == -1) {
+      perrorf ("createUnixListener: socket (...)");
+      return -1;
+   }
+
+   printf ("binding to %s\n", path);
+
+   status = bind (fd, (struct sockaddr*) &address, sizeof (address));
+   if (status == -1) {
+      perrorf ("createUnixListener: bind (%s)", path);
+      close (fd);
+      return -1;
+   }
+
+   status = listen (fd, BACKLOG);
+   if (status == -1) {
+      perrorf ("createUnixListener: listen");
+      close (fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+//------------------------------------------------------------------------------
+//
+int inheritListener (const char* key)
+{
+   const char* listeners = getenv ("FILTER_SERVER_LISTENERS");
+   if (!listeners) return -1;
+
+   // Format is key=fd;key=fd;...
+   //
+   const size_t keyLength = strlen (key);
+   const char* p = listeners;
+   while (*p) {
+      const char* end = strchr (p, ';');
+      if (!end) end = p + strlen (p);
+
+      if ((strncmp (p, key, keyLength) == 0) && (p [keyLength] == '=')) {
+         const int fd = atoi (p + keyLength + 1);
+
+         // Verify this really is a listening socket.
+         //
+         int accepting = 0;
+         socklen_t size = sizeof (accepting);
+         const int status = getsockopt (fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &size);
+         if ((status < 0) || !accepting) {
+            fprintf (stderr, "inherited listener %s (fd %d) is not a listening socket\n",
+                     key, fd);
+            return -1;
+         }
+
+         if (numberClaimed < MAXIMUM_INHERITED) {
+            claimedFds [numberClaimed++] = fd;
+         }
+         printf ("inherited listener %s (fd %d)\n", key, fd);
+         return fd;
+      }
+
+      p = (*end == ';') ? end + 1 : end;
+   }
+
+   return -1;
+}
+
+//------------------------------------------------------------------------------
+//
+void closeUnusedListeners ()
+{
+   const char* listeners = getenv ("FILTER_SERVER_LISTENERS");
+   if (!listeners) return;
+
+   const char* p = listeners;
+   while ((p = strchr (p, '=')) != NULL) {
+      p++;
+      const int fd = atoi (p);
+
+      bool claimed = false;
+      for (int j = 0; j < numberClaimed; j++) {
+         if (claimedFds [j] == fd) claimed = true;
+      }
+
+      if (!claimed) {
+         printf ("closing unused inherited listener (fd %d)\n", fd);
+         close (fd);
+      }
+   }
+
+   unsetenv ("FILTER_SERVER_LISTENERS");
+}
+
 
 // end
 
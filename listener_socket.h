@@ -24,6 +24,37 @@
 #ifndef LISTENER_SOCKET_H
 #define LISTENER_SOCKET_H
 
+// Socket options, as specified on the command line. A zero/false value means
+// leave as per the system default.
+//
+struct SocketTuning {
+   int backlog;               // listen backlog, 0 means as built
+   int deferAccept;           // TCP_DEFER_ACCEPT seconds
+   int fastOpen;              // TCP_FASTOPEN queue length
+   bool noDelay;              // TCP_NODELAY
+   bool cork;                 // TCP_CORK
+   int sendBuffer;            // SO_SNDBUF bytes
+   int receiveBuffer;         // SO_RCVBUF bytes
+   int keepAliveIdle;         // SO_KEEPALIVE and TCP_KEEPIDLE seconds
+   int keepAliveInterval;     // TCP_KEEPINTVL seconds
+   int keepAliveCount;        // TCP_KEEPCNT
+};
+
+// Parses idle[:interval[:count]] keep alive settings.
+// Returns false if invalid.
+//
+bool parseKeepAlive (const char* text, SocketTuning* tuning);
+
+// Applies the backlog, accept, buffer and keep alive options to a listener,
+// created or inherited. Buffer and keep alive options are inherited by the
+// accepted sockets. The TCP options only apply when isTcp is true.
+//
+void applyListenerTuning (const int fd, const SocketTuning* tuning, const bool isTcp);
+
+// Applies the TCP_NODELAY/TCP_CORK options to an accepted TCP socket.
+//
+void applyConnectionTuning (const int fd, const SocketTuning* tuning);
+
 // Creates a listemrr socket for the specified port number
 // on the local host (but not 127.0.0.1).
 // Return value:
@@ -32,4 +63,25 @@
 //
 int createListener (const int local_port);
 
+// Creates a listener socket bound to the specified unix domain socket path.
+// Any existing (stale) socket file at the path is removed first.
+// Return value:
+// >= 0 - file descriptor
+// <  0 - failed.
+//
+int createUnixListener (const char* path);
+
+// Finds the listener socket identified by key, e.g. "tcp:4242", passed to
+// us by our predecessor via the FILTER_SERVER_LISTENERS environment variable.
+// Return value:
+// >= 0 - file descriptor
+// <  0 - not available.
+//
+int inheritListener (const char* key);
+
+// Closes any inherited listener sockets not claimed by inheritListener, e.g.
+// the port was changed, and clears the environment variable.
+//
+void closeUnusedListeners ();
+
 #endif  // LISTENER_SOCKET_H
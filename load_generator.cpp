@@ -0,0 +1,446 @@
+// load_generator.cpp
+//
+// Multi-threaded client load generator for benchmarking filter_server.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define MAXIMUM_THREADS       1000
+#define BUFFER_SIZE           65536
+
+//------------------------------------------------------------------------------
+// Benchmark parameters - shared by all threads.
+//
+static const char* host = "localhost";
+static const char* port = NULL;
+static int concurrency = 1;
+static int totalConnections = 1000;
+static double duration = 0.0;          // seconds, 0 means use totalConnections
+static double connectionRate = 0.0;    // per second over all threads, 0 = max
+static size_t payloadSize = 1024;
+static bool doCompress = false;
+
+static char* payload = NULL;
+static size_t payloadLength = 0;
+static struct addrinfo* serverAddress = NULL;
+
+// Per thread results.
+//
+struct ThreadData {
+   pthread_t thread;
+   int index;
+   double* latencies;         // seconds, one per successful connection
+   int numberOk;
+   int numberFailed;
+   double bytesSent;
+   double bytesReceived;
+};
+
+static ThreadData threadData [MAXIMUM_THREADS];
+static int latencyCapacity = 0;
+static double startTime;
+static pthread_mutex_t counterMutex = PTHREAD_MUTEX_INITIALIZER;
+static int connectionsIssued = 0;
+
+//------------------------------------------------------------------------------
+//
+static double timeNow ()
+{
+   struct timespec spec;
+   clock_gettime (CLOCK_MONOTONIC, &spec);
+   return double (spec.tv_sec) + double (spec.tv_nsec) / 1.0e9;
+}
+
+//------------------------------------------------------------------------------
+//
+static void printUsage (FILE* stream)
+{
+   fprintf (stream,
+            "\n"
+            "usage: load_generator [OPTIONS] [host] port\n"
+            "\n"
+            "--concurrency, -c  Number of client threads (default 1).\n"
+            "--connections, -n  Total number of connections (default 1000).\n"
+            "--duration, -d     Run for this many seconds instead.\n"
+            "--rate, -r         Target connections per second over all threads\n"
+            "                   (default 0, i.e. as fast as possible).\n"
+            "--size, -s         Payload size in bytes, may be qualified with k or M\n"
+            "                   (default 1024).\n"
+            "--zip, -z          Send gzip compressed payload (for a server run with -u).\n"
+            "--help, -h         Show this help information and exit.\n"
+            "\n");
+}
+
+//------------------------------------------------------------------------------
+// Generates printable text payload, compressed if required.
+//
+static bool createPayload ()
+{
+   payload = (char*) malloc (payloadSize + 1);
+   if (!payload) return false;
+
+   const char* const text = "the quick brown fox jumps over the lazy dog 0123456789\n";
+   const size_t textLength = strlen (text);
+   for (size_t j = 0; j < payloadSize; j++) {
+      payload [j] = text [j % textLength];
+   }
+   payloadLength = payloadSize;
+
+   if (!doCompress) return true;
+
+   // Use gzip itself to compress the payload, via a temporary file.
+   //
+   char filename [] = "/tmp/load_generator_XXXXXX";
+   const int fd = mkstemp (filename);
+   if (fd < 0) {
+      perror ("mkstemp");
+      return false;
+   }
+   const ssize_t count = write (fd, payload, payloadLength);
+   close (fd);
+   if (count != ssize_t (payloadLength)) {
+      unlink (filename);
+      return false;
+   }
+
+   char command [100];
+   snprintf (command, sizeof (command), "gzip -c < %s", filename);
+   FILE* pipe = popen (command, "r");
+   if (!pipe) {
+      perror ("popen (gzip)");
+      unlink (filename);
+      return false;
+   }
+
+   size_t length = 0;
+   size_t n;
+   while ((n = fread (payload + length, 1, payloadSize + 1 - length, pipe)) > 0) {
+      length += n;
+      if (length > payloadSize) {
+         // Compressed larger than original (tiny payloads) - grow.
+         //
+         payloadSize *= 2;
+         payload = (char*) realloc (payload, payloadSize + 1);
+      }
+   }
+   pclose (pipe);
+   unlink (filename);
+
+   payloadLength = length;
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Runs one session: connect, send payload, half close and read until EOF.
+// Returns true if successful.
+//
+static bool runSession (ThreadData* data, char* buffer)
+{
+   const int fd = socket (serverAddress->ai_family, serverAddress->ai_socktype,
+                          serverAddress->ai_protocol);
+   if (fd < 0) return false;
+
+   if (connect (fd, serverAddress->ai_addr, serverAddress->ai_addrlen) < 0) {
+      close (fd);
+      return false;
+   }
+
+   fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | O_NONBLOCK);
+
+   // Interleave send and receive - the server may well echo input before
+   // we have sent it all, so we must not block on either.
+   //
+   size_t sent = 0;
+   bool isShutdown = false;
+   bool result = true;
+
+   while (true) {
+      struct pollfd item;
+      item.fd = fd;
+      item.events = POLLIN | (isShutdown ? 0 : POLLOUT);
+      item.revents = 0;
+
+      if (!isShutdown && (sent >= payloadLength)) {
+         shutdown (fd, SHUT_WR);
+         isShutdown = true;
+         continue;
+      }
+
+      const int status = poll (&item, 1, 10000);
+      if (status <= 0) {
+         result = false;   // timeout or error
+         break;
+      }
+
+      if (item.revents & POLLOUT) {
+         const ssize_t n = send (fd, payload + sent, payloadLength - sent, MSG_NOSIGNAL);
+         if (n > 0) {
+            sent += n;
+            data->bytesSent += n;
+         } else if ((n < 0) && (errno != EAGAIN)) {
+            result = false;
+            break;
+         }
+      }
+
+      if (item.revents & (POLLIN | POLLHUP | POLLERR)) {
+         const ssize_t n = recv (fd, buffer, BUFFER_SIZE, 0);
+         if (n > 0) {
+            data->bytesReceived += n;
+         } else if (n == 0) {
+            break;    // end of file - all done
+         } else if (errno != EAGAIN) {
+            result = false;
+            break;
+         }
+      }
+   }
+
+   close (fd);
+   return result && isShutdown;
+}
+
+//------------------------------------------------------------------------------
+//
+static void* threadMain (void* arg)
+{
+   ThreadData* data = (ThreadData*) arg;
+   char* buffer = (char*) malloc (BUFFER_SIZE);
+
+   while (true) {
+      int sequence;
+
+      pthread_mutex_lock (&counterMutex);
+      sequence = connectionsIssued++;
+      pthread_mutex_unlock (&counterMutex);
+
+      if ((duration <= 0.0) && (sequence >= totalConnections)) break;
+      if ((duration > 0.0) && (timeNow () >= startTime + duration)) break;
+
+      // Pace the connections if a rate was specified. Connection n is due at
+      // start + n/rate, i.e. an open loop schedule, and its latency is
+      // measured from when it was due, not from when it was sent, so that a
+      // stalled server is not hidden by the connections it delayed
+      // (coordinated omission).
+      //
+      double t0 = timeNow ();
+      if (connectionRate > 0.0) {
+         const double due = startTime + double (sequence) / connectionRate;
+         const double wait = due - t0;
+         if (wait > 0.0) usleep (useconds_t (wait * 1.0e6));
+         t0 = due;
+      }
+
+      if (runSession (data, buffer)) {
+         if (data->numberOk < latencyCapacity) {
+            data->latencies [data->numberOk++] = timeNow () - t0;
+         }
+      } else {
+         data->numberFailed++;
+      }
+   }
+
+   free (buffer);
+   return NULL;
+}
+
+//------------------------------------------------------------------------------
+//
+static int compareDoubles (const void* a, const void* b)
+{
+   const double x = *(const double*) a;
+   const double y = *(const double*) b;
+   return (x < y) ? -1 : (x > y) ? +1 : 0;
+}
+
+//------------------------------------------------------------------------------
+//
+static bool parseSize (const char* text, size_t& size)
+{
+   double value = 0.0;
+   char xx = ' ';
+   const int n = sscanf (text, "%lf%c", &value, &xx);
+   if (n < 1) return false;
+   if (xx == 'k') value *= 1024.0;
+   else if (xx == 'M') value *= 1048576.0;
+   else if (xx != ' ') return false;
+   size = size_t (value);
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+int main (int argc, char** argv)
+{
+   while (true) {
+      int option_index = 0;
+
+      static const struct option long_options[] = {
+         {"help", no_argument, NULL, 'h'},
+         {"concurrency", required_argument, NULL, 'c'},
+         {"connections", required_argument, NULL, 'n'},
+         {"duration", required_argument, NULL, 'd'},
+         {"rate", required_argument, NULL, 'r'},
+         {"size", required_argument, NULL, 's'},
+         {"zip", no_argument, NULL, 'z'},
+         {NULL, 0, NULL, 0}
+      };
+
+      const int c = getopt_long (argc, argv, "hc:n:d:r:s:z", long_options, &option_index);
+      if (c == -1)
+         break;
+
+      switch (c) {
+         case 'h':
+            printUsage (stdout);
+            return 0;
+
+         case 'c':
+            concurrency = atoi (optarg);
+            break;
+
+         case 'n':
+            totalConnections = atoi (optarg);
+            break;
+
+         case 'd':
+            duration = atof (optarg);
+            break;
+
+         case 'r':
+            connectionRate = atof (optarg);
+            break;
+
+         case 's':
+            if (!parseSize (optarg, payloadSize)) {
+               printUsage (stderr);
+               return 1;
+            }
+            break;
+
+         case 'z':
+            doCompress = true;
+            break;
+
+         default:
+            printUsage (stderr);
+            return 1;
+      }
+   }
+
+   const int numberArgs = argc - optind;
+   if (numberArgs == 1) {
+      port = argv [optind];
+   } else if (numberArgs == 2) {
+      host = argv [optind];
+      port = argv [optind + 1];
+   } else {
+      printUsage (stderr);
+      return 1;
+   }
+
+   if (concurrency < 1) concurrency = 1;
+   if (concurrency > MAXIMUM_THREADS) concurrency = MAXIMUM_THREADS;
+
+   struct addrinfo hints;
+   memset (&hints, 0, sizeof (hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   const int status = getaddrinfo (host, port, &hints, &serverAddress);
+   if (status != 0) {
+      fprintf (stderr, "getaddrinfo (%s, %s): %s\n", host, port, gai_strerror (status));
+      return 2;
+   }
+
+   if (!createPayload ()) {
+      fprintf (stderr, "failed to create payload\n");
+      return 2;
+   }
+
+   // Size the latency arrays. When running for a duration we don't know in
+   // advance, so allow for a generous connection rate.
+   //
+   latencyCapacity = totalConnections;
+   if (duration > 0.0) {
+      latencyCapacity = int (duration * (connectionRate > 0.0 ? connectionRate : 20000.0)) + 1;
+   }
+
+   for (int j = 0; j < concurrency; j++) {
+      ThreadData* data = &threadData [j];
+      memset (data, 0, sizeof (ThreadData));
+      data->index = j;
+      data->latencies = (double*) malloc (sizeof (double) * latencyCapacity);
+   }
+
+   startTime = timeNow ();
+   for (int j = 0; j < concurrency; j++) {
+      pthread_create (&threadData [j].thread, NULL, threadMain, &threadData [j]);
+   }
+   for (int j = 0; j < concurrency; j++) {
+      pthread_join (threadData [j].thread, NULL);
+   }
+   const double elapsed = timeNow () - startTime;
+
+   // Gather the results.
+   //
+   int numberOk = 0;
+   int numberFailed = 0;
+   double bytes = 0.0;
+   for (int j = 0; j < concurrency; j++) {
+      numberOk += threadData [j].numberOk;
+      numberFailed += threadData [j].numberFailed;
+      bytes += threadData [j].bytesSent + threadData [j].bytesReceived;
+   }
+
+   double* all = (double*) malloc (sizeof (double) * (numberOk + 1));
+   int k = 0;
+   for (int j = 0; j < concurrency; j++) {
+      memcpy (&all [k], threadData [j].latencies, sizeof (double) * threadData [j].numberOk);
+      k += threadData [j].numberOk;
+   }
+   qsort (all, numberOk, sizeof (double), compareDoubles);
+
+   #define PERCENTILE(p) (numberOk > 0 ? 1000.0 * all [int ((p) * (numberOk - 1))] : 0.0)
+
+   fprintf (stdout, "connections:  %d ok, %d failed in %.3f s\n", numberOk, numberFailed, elapsed);
+   fprintf (stdout, "rate:         %.1f connections/s\n", numberOk / elapsed);
+   fprintf (stdout, "throughput:   %.2f MB/s (sent + received)\n", bytes / elapsed / 1.0e6);
+   fprintf (stdout, "latency (ms): p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+            PERCENTILE (0.50), PERCENTILE (0.99), PERCENTILE (0.999), PERCENTILE (1.0));
+
+   #undef PERCENTILE
+
+   freeaddrinfo (serverAddress);
+   return numberFailed > 0 ? 3 : 0;
+}
+
+// end
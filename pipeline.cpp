@@ -0,0 +1,181 @@
+// pipeline.cpp
+//
+// Multi-stage filter pipelines.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#include "pipeline.h"
+#include "utilities.h"
+#include "capture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define RELAY_CHUNK           (1 << 20)
+
+//------------------------------------------------------------------------------
+//
+bool buildPipeline (const char* const argv [], const bool isPipeline,
+                    const int defaultPipeSize, Pipeline* pipeline)
+{
+   int n = 0;
+   int stage = 0;
+
+   pipeline->defaultPipeSize = defaultPipeSize;
+   pipeline->stageArgv [0] = &pipeline->args [0];
+   pipeline->pipeSize [0] = 0;
+
+   for (int j = 0; argv [j]; j++) {
+      if (n >= MAXIMUM_PIPELINE_ARGS + MAXIMUM_STAGES - 1) {
+         fprintf (stderr, "pipeline has too many arguments\n");
+         return false;
+      }
+
+      if (!isPipeline || (argv [j][0] != '|')) {
+         pipeline->args [n++] = argv [j];
+         continue;
+      }
+
+      // Stage separator - terminate this stage's arguments.
+      //
+      if (pipeline->stageArgv [stage] == &pipeline->args [n]) {
+         fprintf (stderr, "pipeline has an empty stage\n");
+         return false;
+      }
+      pipeline->args [n++] = NULL;
+
+      double size = 0.0;
+      if ((argv [j][1] != '\0') && !parseSize (&argv [j][1], size)) {
+         fprintf (stderr, "invalid pipe size %s\n", argv [j]);
+         return false;
+      }
+      pipeline->pipeSize [stage] = int (size);
+
+      stage++;
+      if (stage >= MAXIMUM_STAGES) {
+         fprintf (stderr, "pipeline has too many stages, maximum is %d\n", MAXIMUM_STAGES);
+         return false;
+      }
+      pipeline->stageArgv [stage] = &pipeline->args [n];
+      pipeline->pipeSize [stage] = 0;
+   }
+
+   if (pipeline->stageArgv [stage] == &pipeline->args [n]) {
+      fprintf (stderr, "pipeline has an empty stage\n");
+      return false;
+   }
+   pipeline->args [n] = NULL;
+   pipeline->numberStages = stage + 1;
+
+   // The final stage is exec-ed by the session process itself.
+   //
+   if (strcmp (pipeline->stageArgv [stage][0], RELAY_STAGE) == 0) {
+      fprintf (stderr, "the final pipeline stage may not be %s\n", RELAY_STAGE);
+      return false;
+   }
+
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+void setPipeSize (const int fd, const int size)
+{
+   if (size <= 0) return;
+
+   const int status = fcntl (fd, F_SETPIPE_SZ, size);
+   if (status < 0) {
+      // Most likely exceeds /proc/sys/fs/pipe-max-size for a non-root user.
+      //
+      perrorf ("fcntl (%d, F_SETPIPE_SZ, %d)", fd, size);
+   }
+}
+
+//------------------------------------------------------------------------------
+//
+size_t pipeCapacity (const int fd)
+{
+   const int size = fcntl (fd, F_GETPIPE_SZ);
+   return size > 0 ? size_t (size) : 65536;
+}
+
+//------------------------------------------------------------------------------
+// NOTE: This function does not return.
+//
+void runRelay ()
+{
+   bool useSplice = true;
+   char* buffer = NULL;
+
+   while (true) {
+      ssize_t n;
+
+      if (useSplice) {
+         // At least one of stdin/stdout must be a pipe for splice to work,
+         // which is always the case for a pipeline stage.
+         //
+         n = splice (STDIN_FILENO, NULL, STDOUT_FILENO, NULL, RELAY_CHUNK,
+                     SPLICE_F_MOVE | SPLICE_F_MORE);
+         if ((n < 0) && (errno == EINVAL)) {
+            useSplice = false;
+            continue;
+         }
+      } else {
+         if (!buffer) buffer = new char [RELAY_CHUNK];
+         n = read (STDIN_FILENO, buffer, RELAY_CHUNK);
+         for (ssize_t done = 0; done < n; ) {
+            const ssize_t m = write (STDOUT_FILENO, buffer + done, n - done);
+            if (m < 0) {
+               if (errno == EINTR) continue;
+               perror ("runRelay.write");
+               _exit (4);
+            }
+            done += m;
+         }
+      }
+
+      if (n == 0) break;    // end of file
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         perror ("runRelay");
+         _exit (4);
+      }
+   }
+
+   _exit (0);
+}
+
+//------------------------------------------------------------------------------
+//
+void runBuiltinStage (const char* const argv [])
+{
+   if (strcmp (argv [0], RELAY_STAGE) == 0) {
+      runRelay ();
+   } else if (strcmp (argv [0], CAPTURE_INPUT_STAGE) == 0) {
+      runCaptureInput ();
+   } else if (strcmp (argv [0], CAPTURE_OUTPUT_STAGE) == 0) {
+      runCaptureOutput ();
+   }
+}
+
+// end
@@ -0,0 +1,81 @@
+// pipeline.h
+//
+// Multi-stage filter pipelines.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+
+#define MAXIMUM_STAGES        16
+#define MAXIMUM_PIPELINE_ARGS 64
+
+// The name of the in-server relay stage. This stage is run by a forked copy of
+// filter_server itself (no exec) and just copies its input to its output
+// using splice. This decouples adjacent stages with an extra pipe buffer
+// without the cost of starting another program.
+//
+#define RELAY_STAGE           "@relay"
+
+// When pipelines are enabled (--pipeline, or pipeline = yes), a pipeline is
+// specified as a list of arguments where a "|" argument separates the stages,
+// e.g.
+//
+//    gunzip | tr a-z A-Z | gzip
+//
+// The separator may be qualified with the size of the pipe following
+// the stage, e.g. "|1M" (may be qualified with k or M).
+//
+struct Pipeline {
+   int numberStages;
+   const char* args [MAXIMUM_PIPELINE_ARGS + MAXIMUM_STAGES + 1];
+   const char* const* stageArgv [MAXIMUM_STAGES];   // into args
+   int pipeSize [MAXIMUM_STAGES];   // pipe out of stage j, 0 for default
+   int defaultPipeSize;             // 0 for system default
+};
+
+// Splits argv (NULL terminated) into the pipeline stages. If isPipeline is
+// false, "|" arguments are passed to the command as is, i.e. one stage.
+// Returns false (and reports the error) if invalid.
+//
+bool buildPipeline (const char* const argv [], const bool isPipeline,
+                    const int defaultPipeSize, Pipeline* pipeline);
+
+// Sets the capacity of the pipe, if size > 0. Failure is reported but not fatal.
+//
+void setPipeSize (const int fd, const int size);
+
+// Returns the capacity of the pipe, or 64k if this cannot be determined.
+//
+size_t pipeCapacity (const int fd);
+
+// Copies stdin to stdout until end of file, then exits.
+// NOTE: This function does not return.
+//
+void runRelay ();
+
+// If argv[0] names an in-server stage, i.e. RELAY_STAGE or one of the capture
+// stages, runs that stage and does not return, otherwise just returns.
+//
+void runBuiltinStage (const char* const argv []);
+
+#endif  // PIPELINE_H
@@ -0,0 +1,76 @@
+// probes.h
+//
+// Static user space tracepoints (USDT) for filter_server.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#ifndef PROBES_H
+#define PROBES_H
+
+// The probes use <sys/sdt.h> (from systemtap-sdt-dev or systemtap-sdt-devel),
+// which just places a nop instruction and an ELF note at each probe site, so
+// the cost when not being traced is negligible. If the header is not available,
+// or NO_SDT_PROBES is defined, the probes compile to nothing.
+//
+// All probes are in the filter_server provider, e.g.
+//
+//    bpftrace -e 'usdt:./filter_server:filter_server:exec { printf ("%d\n", pid); }'
+//    perf buildid-cache --add ./filter_server; perf list sdt_filter_server:*
+//
+// Probes, and their arguments:
+//
+//   accept          connection fd, client IPv4 address (network order),
+//                   estimated accept wait (micro seconds, -1 if unknown)
+//   fork_start      slot
+//   fork_done       child pid                          (parent)
+//   child_start     -                                  (child)
+//   close_start     maximum fd
+//   close_done      -
+//   helpers_start   input is compressed, do compress output
+//   helpers_done    -
+//   exec            command                            (about to exec)
+//   exec_done       command                            (--trace-phases only)
+//   session_done    pid, exit status, duration (micro seconds)
+//
+// The accept wait is the time since the last segment was received from the
+// client (see getAcceptWait), i.e. a lower bound to kernel tick resolution.
+// exec_done fires in the --trace-phases watcher process when the exec of the
+// filter succeeds; otherwise use the sched:sched_process_exec tracepoint.
+//
+#if defined (__has_include) && !defined (NO_SDT_PROBES)
+#if __has_include (<sys/sdt.h>)
+#include <sys/sdt.h>
+#define FILTER_SERVER_HAS_PROBES
+#endif
+#endif
+
+#ifdef FILTER_SERVER_HAS_PROBES
+#define PROBE0(name)              DTRACE_PROBE (filter_server, name)
+#define PROBE1(name, a)           DTRACE_PROBE1 (filter_server, name, a)
+#define PROBE2(name, a, b)        DTRACE_PROBE2 (filter_server, name, a, b)
+#define PROBE3(name, a, b, c)     DTRACE_PROBE3 (filter_server, name, a, b, c)
+#else
+#define PROBE0(name)              do { } while (false)
+#define PROBE1(name, a)           do { (void) (a); } while (false)
+#define PROBE2(name, a, b)        do { (void) (a); (void) (b); } while (false)
+#define PROBE3(name, a, b, c)     do { (void) (a); (void) (b); (void) (c); } while (false)
+#endif
+
+#endif  // PROBES_H
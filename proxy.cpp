@@ -0,0 +1,563 @@
+// proxy.cpp
+//
+// Forwarding proxy to backend filter_server instances.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+
+#include "proxy.h"
+#include "pipeline.h"
+#include "utilities.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/mman.h>
+
+#define POINTS_PER_BACKEND    64
+#define CHECK_INTERVAL        2.0     // removed backends
+#define IDLE_CHECK_INTERVAL   30.0    // healthy but unused backends
+#define CHECK_TIMEOUT         1.0
+#define FAILURES_TO_REMOVE    2
+#define CONNECT_TIMEOUT       2.0
+#define RELAY_CHUNK           (1 << 16)
+
+//------------------------------------------------------------------------------
+// FNV-1a hash.
+//
+static uint32_t hashOf (const void* data, const size_t size)
+{
+   const unsigned char* p = (const unsigned char*) data;
+   uint32_t hash = 2166136261u;
+   for (size_t j = 0; j < size; j++) {
+      hash ^= p [j];
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+//------------------------------------------------------------------------------
+//
+static int compareRingPoints (const void* a, const void* b)
+{
+   const uint32_t ha = ((const ProxyBackends::RingPoint*) a)->hash;
+   const uint32_t hb = ((const ProxyBackends::RingPoint*) b)->hash;
+   return (ha > hb) - (ha < hb);
+}
+
+//------------------------------------------------------------------------------
+// Resolves host:port (or [host]:port) into the backend address.
+//
+static bool resolveBackend (Backend* backend)
+{
+   char host [80];
+   snprintf (host, sizeof (host), "%s", backend->name);
+
+   char* colon = strrchr (host, ':');
+   if (!colon || (colon == host) || (colon [1] == '\0')) {
+      fprintf (stderr, "backend %s: expecting host:port\n", backend->name);
+      return false;
+   }
+   *colon = '\0';
+   const char* port = colon + 1;
+
+   char* name = host;
+   if ((name [0] == '[') && (colon [-1] == ']')) {
+      colon [-1] = '\0';
+      name++;
+   }
+
+   struct addrinfo hints;
+   struct addrinfo* info;
+   memset (&hints, 0, sizeof (hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+
+   const int status = getaddrinfo (name, port, &hints, &info);
+   if (status != 0) {
+      fprintf (stderr, "backend %s: getaddrinfo failed: %s\n",
+               backend->name, gai_strerror (status));
+      return false;
+   }
+
+   memcpy (&backend->address, info->ai_addr, info->ai_addrlen);
+   backend->addressSize = info->ai_addrlen;
+   freeaddrinfo (info);
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Starts a non-blocking connect to the backend.
+// Returns the socket, or -1 if the connect failed immediately.
+//
+static int startConnect (const Backend* backend)
+{
+   const int fd = socket (backend->address.ss_family, SOCK_STREAM, 0);
+   if (fd < 0) {
+      perrorf ("socket (backend %s)", backend->name);
+      return -1;
+   }
+
+   setNonBlocking (fd);
+   const int status = connect (fd, (const struct sockaddr*) &backend->address,
+                               backend->addressSize);
+   if ((status < 0) && (errno != EINPROGRESS)) {
+      close (fd);
+      return -1;
+   }
+   return fd;
+}
+
+//------------------------------------------------------------------------------
+// Returns +1 if the connect has completed, -1 if it failed and 0 if still
+// in progress after waiting up to timeout seconds.
+//
+static int connectStatus (const int fd, const double timeout)
+{
+   struct pollfd item;
+   item.fd = fd;
+   item.events = POLLOUT;
+   item.revents = 0;
+
+   const int status = poll (&item, 1, int (1000.0 * timeout));
+   if (status == 0) return 0;
+   if (status < 0) return errno == EINTR ? 0 : -1;
+
+   int error = 0;
+   socklen_t size = sizeof (error);
+   getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &size);
+   return error == 0 ? +1 : -1;
+}
+
+//------------------------------------------------------------------------------
+//
+bool parseBalancePolicy (const char* text, BalancePolicy& balance)
+{
+   if (strcmp (text, "least") == 0) {
+      balance = bpLeastConnections;
+   } else if (strcmp (text, "hash") == 0) {
+      balance = bpConsistentHash;
+   } else {
+      fprintf (stderr, "invalid balance policy '%s', expecting least or hash\n", text);
+      return false;
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+ProxyBackends* createProxyBackends (const char* list, const BalancePolicy balance)
+{
+   ProxyBackends* proxy = (ProxyBackends*) calloc (1, sizeof (ProxyBackends));
+   proxy->balance = balance;
+   proxy->number = 0;
+
+   const char* p = list;
+   while (*p) {
+      const char* end = strchr (p, ',');
+      const size_t length = end ? size_t (end - p) : strlen (p);
+
+      if (length > 0) {
+         if (proxy->number >= MAXIMUM_BACKENDS) {
+            fprintf (stderr, "too many backends, maximum is %d\n", MAXIMUM_BACKENDS);
+            free (proxy);
+            return NULL;
+         }
+         if (length >= sizeof (proxy->backends [0].name)) {
+            fprintf (stderr, "backend name too long: %.*s\n", int (length), p);
+            free (proxy);
+            return NULL;
+         }
+
+         Backend* backend = &proxy->backends [proxy->number++];
+         memcpy (backend->name, p, length);
+         backend->name [length] = '\0';
+         if (!resolveBackend (backend)) {
+            free (proxy);
+            return NULL;
+         }
+         backend->isHealthy = true;
+         backend->numberRunning = 0;
+         backend->failures = 0;
+         backend->isInUse = false;
+         backend->connectFailuresSeen = 0;
+         backend->checkFd = -1;
+         backend->nextCheckTime = 0.0;
+      }
+
+      if (!end) break;
+      p = end + 1;
+   }
+
+   if (proxy->number == 0) {
+      fprintf (stderr, "no backends specified\n");
+      free (proxy);
+      return NULL;
+   }
+
+   // Shared with the session processes, which count connect failures.
+   //
+   void* shared = mmap (NULL, sizeof (uint32_t) * MAXIMUM_BACKENDS, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (shared == MAP_FAILED) {
+      perrorf ("createProxyBackends.mmap()");
+      free (proxy);
+      return NULL;
+   }
+   proxy->connectFailures = (uint32_t*) shared;
+
+   // Build the consistent hash ring. Each backend has a number of points on
+   // the ring, so that removing a backend only moves that backend's clients,
+   // spread over the remaining backends.
+   //
+   proxy->numberPoints = 0;
+   for (int b = 0; b < proxy->number; b++) {
+      for (int k = 0; k < POINTS_PER_BACKEND; k++) {
+         char key [100];
+         const int n = snprintf (key, sizeof (key), "%s#%d", proxy->backends [b].name, k);
+         ProxyBackends::RingPoint* point = &proxy->ring [proxy->numberPoints++];
+         point->hash = hashOf (key, n);
+         point->backend = b;
+      }
+   }
+   qsort (proxy->ring, proxy->numberPoints, sizeof (proxy->ring [0]), compareRingPoints);
+
+   return proxy;
+}
+
+//------------------------------------------------------------------------------
+// Selects a healthy backend, excluding those flagged in exclude (if not NULL).
+// Returns -1 if there are none.
+//
+static int selectBackend (const ProxyBackends* proxy, const struct sockaddr* clientAddress,
+                          const int next, const bool* exclude)
+{
+   int result = -1;
+
+   if (proxy->balance == bpConsistentHash) {
+      // Find the first ring point at or after the client's hash, skipping
+      // the points of unhealthy (or excluded) backends.
+      //
+      uint32_t hash = 0;
+      if (clientAddress->sa_family == AF_INET) {
+         const struct in_addr* addr = &((const struct sockaddr_in*) clientAddress)->sin_addr;
+         hash = hashOf (addr, sizeof (*addr));
+      } else if (clientAddress->sa_family == AF_INET6) {
+         const struct in6_addr* addr = &((const struct sockaddr_in6*) clientAddress)->sin6_addr;
+         hash = hashOf (addr, sizeof (*addr));
+      }
+      int first = 0;
+      while ((first < proxy->numberPoints) && (proxy->ring [first].hash < hash)) {
+         first++;
+      }
+
+      for (int k = 0; k < proxy->numberPoints; k++) {
+         const int b = proxy->ring [(first + k) % proxy->numberPoints].backend;
+         if (proxy->backends [b].isHealthy && !(exclude && exclude [b])) {
+            result = b;
+            break;
+         }
+      }
+
+   } else {
+      // Least connections, ties resolved round robin.
+      //
+      for (int k = 0; k < proxy->number; k++) {
+         const int b = (next + k) % proxy->number;
+         const Backend* backend = &proxy->backends [b];
+         if (!backend->isHealthy || (exclude && exclude [b])) continue;
+         if ((result < 0) || (backend->numberRunning < proxy->backends [result].numberRunning)) {
+            result = b;
+         }
+      }
+   }
+
+   return result;
+}
+
+//------------------------------------------------------------------------------
+//
+int chooseBackend (ProxyBackends* proxy, const struct sockaddr* clientAddress)
+{
+   static int next = 0;
+
+   const int result = selectBackend (proxy, clientAddress, next, NULL);
+   if (result >= 0) {
+      next = (result + 1) % proxy->number;
+      proxy->backends [result].numberRunning++;
+   }
+   return result;
+}
+
+//------------------------------------------------------------------------------
+//
+void releaseBackend (ProxyBackends* proxy, const int backend, const bool connectFailed)
+{
+   if ((backend < 0) || (backend >= proxy->number)) return;
+
+   Backend* item = &proxy->backends [backend];
+   item->numberRunning--;
+
+   if (!connectFailed) {
+      item->isInUse = true;
+   } else if (item->isHealthy) {
+      fprintf (stdout, "Backend %s connect failed - removed\n", item->name);
+      item->isHealthy = false;
+      item->failures = FAILURES_TO_REMOVE;
+   }
+}
+
+//------------------------------------------------------------------------------
+//
+void checkBackends (ProxyBackends* proxy, const double timeNow)
+{
+   for (int b = 0; b < proxy->number; b++) {
+      Backend* backend = &proxy->backends [b];
+
+      // A session that failed to connect, and then tried another backend.
+      //
+      const uint32_t connectFailures = __atomic_load_n (&proxy->connectFailures [b],
+                                                        __ATOMIC_RELAXED);
+      if (connectFailures != backend->connectFailuresSeen) {
+         backend->connectFailuresSeen = connectFailures;
+         if (backend->isHealthy) {
+            fprintf (stdout, "Backend %s connect failed - removed\n", backend->name);
+            backend->isHealthy = false;
+            backend->failures = FAILURES_TO_REMOVE;
+            backend->nextCheckTime = timeNow + CHECK_INTERVAL;
+         }
+      }
+
+      if (backend->checkFd < 0) {
+         if (timeNow < backend->nextCheckTime) continue;
+
+         // Sessions connecting successfully are evidence enough, and save
+         // the backend from running an empty session for the check.
+         //
+         if (backend->isHealthy && backend->isInUse) {
+            backend->isInUse = false;
+            backend->nextCheckTime = timeNow + IDLE_CHECK_INTERVAL;
+            continue;
+         }
+
+         backend->checkStartTime = timeNow;
+         backend->nextCheckTime = timeNow +
+               (backend->isHealthy ? IDLE_CHECK_INTERVAL : CHECK_INTERVAL);
+         backend->checkFd = startConnect (backend);
+         if (backend->checkFd >= 0) continue;   // check in progress
+      }
+
+      int outcome = -1;
+      if (backend->checkFd >= 0) {
+         outcome = connectStatus (backend->checkFd, 0.0);
+         if ((outcome == 0) && (timeNow < backend->checkStartTime + CHECK_TIMEOUT)) {
+            continue;   // still in progress
+         }
+         close (backend->checkFd);
+         backend->checkFd = -1;
+      }
+
+      if (outcome > 0) {
+         if (!backend->isHealthy) {
+            fprintf (stdout, "Backend %s is healthy - restored\n", backend->name);
+         }
+         backend->isHealthy = true;
+         backend->failures = 0;
+      } else {
+         backend->failures++;
+         backend->nextCheckTime = backend->checkStartTime + CHECK_INTERVAL;
+         if (backend->isHealthy && (backend->failures >= FAILURES_TO_REMOVE)) {
+            fprintf (stdout, "Backend %s failed %d checks - removed\n",
+                     backend->name, backend->failures);
+            backend->isHealthy = false;
+         }
+      }
+   }
+}
+
+//------------------------------------------------------------------------------
+//
+void reportBackends (const ProxyBackends* proxy)
+{
+   fprintf (stdout, "proxy to :         ");
+   for (int b = 0; b < proxy->number; b++) {
+      fprintf (stdout, "%s ", proxy->backends [b].name);
+   }
+   fprintf (stdout, "\n");
+   fprintf (stdout, "balance :          %s\n", proxy->balance == bpConsistentHash ?
+            "consistent hash" : "least connections");
+}
+
+//------------------------------------------------------------------------------
+// One direction of the relay: source socket -> pipe -> destination socket.
+//
+struct RelayDirection {
+   int source;
+   int destination;
+   int pipeFds [2];
+   size_t inPipe;             // bytes held in the pipe
+   size_t capacity;           // pipe capacity
+   bool isEndOfFile;
+   bool isShutdown;
+};
+
+//------------------------------------------------------------------------------
+// Moves what data it can without blocking.
+// Returns false on error.
+//
+static bool relayData (RelayDirection* dir, const short sourceEvents,
+                       const short destinationEvents)
+{
+   if (!dir->isEndOfFile && (dir->inPipe < dir->capacity) &&
+       (sourceEvents & (POLLIN | POLLHUP | POLLERR))) {
+      const ssize_t n = splice (dir->source, NULL, dir->pipeFds [1], NULL, RELAY_CHUNK,
+                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+         dir->inPipe += n;
+      } else if (n == 0) {
+         dir->isEndOfFile = true;
+      } else if ((errno != EAGAIN) && (errno != EINTR)) {
+         return false;
+      }
+   }
+
+   if ((dir->inPipe > 0) && (destinationEvents & (POLLOUT | POLLERR))) {
+      const ssize_t n = splice (dir->pipeFds [0], NULL, dir->destination, NULL, dir->inPipe,
+                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+         dir->inPipe -= n;
+      } else if ((n < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+         return false;
+      }
+   }
+
+   // Propagate the end of file once all the data has been delivered.
+   //
+   if (dir->isEndOfFile && (dir->inPipe == 0) && !dir->isShutdown) {
+      shutdown (dir->destination, SHUT_WR);
+      dir->isShutdown = true;
+   }
+
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// NOTE: This function does not return.
+//
+void runProxySession (const int connectionFd, const ProxyBackends* proxy,
+                      const int backend, const struct sockaddr* clientAddress,
+                      const int pipeSize)
+{
+   // As per runChildProcess, close all inherited files (e.g. connections
+   // retained by the server on behalf of other sessions) except the client
+   // connection, which becomes stdin.
+   //
+   if (dup2 (connectionFd, STDIN_FILENO) != STDIN_FILENO) {
+      perror ("dup2 (fd, STDIN_FILENO)");
+      _exit (4);
+   }
+   const int maxfd = sysconf (_SC_OPEN_MAX);
+   for (int tfd = 3; tfd <= maxfd; tfd++) {
+      close (tfd);
+   }
+   const int clientFd = STDIN_FILENO;
+
+   // If the chosen backend is down, try the other healthy backends in
+   // turn, as per the balance policy, rather than drop the client.
+   //
+   bool tried [MAXIMUM_BACKENDS] = { false };
+   int backendFd = -1;
+   int b = backend;
+   while (b >= 0) {
+      const Backend* item = &proxy->backends [b];
+      backendFd = startConnect (item);
+      if ((backendFd >= 0) && (connectStatus (backendFd, CONNECT_TIMEOUT) > 0)) break;
+
+      fprintf (stderr, "Unable to connect to backend %s\n", item->name);
+      if (backendFd >= 0) close (backendFd);
+      backendFd = -1;
+      __atomic_fetch_add (&proxy->connectFailures [b], 1, __ATOMIC_RELAXED);
+      tried [b] = true;
+      b = selectBackend (proxy, clientAddress, b + 1, tried);
+   }
+   if (backendFd < 0) {
+      _exit (PROXY_CONNECT_FAILED);
+   }
+   setNonBlocking (clientFd);
+
+   RelayDirection upstream = { clientFd, backendFd, { -1, -1 }, 0, 0, false, false };
+   RelayDirection downstream = { backendFd, clientFd, { -1, -1 }, 0, 0, false, false };
+
+   if ((pipe (upstream.pipeFds) < 0) || (pipe (downstream.pipeFds) < 0)) {
+      perrorf ("runProxySession.pipe()");
+      _exit (4);
+   }
+   setPipeSize (upstream.pipeFds [0], pipeSize);
+   setPipeSize (downstream.pipeFds [0], pipeSize);
+   upstream.capacity = pipeCapacity (upstream.pipeFds [0]);
+   downstream.capacity = pipeCapacity (downstream.pipeFds [0]);
+
+   while (!(upstream.isShutdown && downstream.isShutdown)) {
+      struct pollfd items [2];
+      items [0].fd = clientFd;
+      items [0].events = 0;
+      items [1].fd = backendFd;
+      items [1].events = 0;
+
+      // Only read from a source while its pipe has room, otherwise just
+      // wait for the destination to drain the pipe.
+      //
+      if (!upstream.isEndOfFile && (upstream.inPipe < upstream.capacity))
+         items [0].events |= POLLIN;
+      if (upstream.inPipe > 0) items [1].events |= POLLOUT;
+      if (!downstream.isEndOfFile && (downstream.inPipe < downstream.capacity))
+         items [1].events |= POLLIN;
+      if (downstream.inPipe > 0) items [0].events |= POLLOUT;
+
+      // POLLHUP/POLLERR are reported even when no events are requested, so
+      // ignore a socket we are not currently waiting on.
+      //
+      if (items [0].events == 0) items [0].fd = -1;
+      if (items [1].events == 0) items [1].fd = -1;
+
+      const int status = poll (items, 2, -1);
+      if (status < 0) {
+         if (errno == EINTR) continue;
+         perror ("runProxySession.poll");
+         _exit (4);
+      }
+
+      if (!relayData (&upstream, items [0].revents, items [1].revents) ||
+          !relayData (&downstream, items [1].revents, items [0].revents)) {
+         // Typically connection reset by the client or backend.
+         //
+         _exit (6);
+      }
+   }
+
+   _exit (0);
+}
+
+// end
@@ -0,0 +1,125 @@
+// proxy.h
+//
+// Forwarding proxy to backend filter_server instances.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// In proxy mode, rather than running a filter command, each session connects
+// to one of a set of backend filter_server instances and relays the data
+// between the client and the backend using splice. The session is otherwise
+// subject to the same rules (timeouts, bandwidth, cgroups etc.) as a filter.
+//
+// Backends are checked by attempting to connect to them. A filter_server
+// backend sees such a check as an (empty) session, so a healthy backend
+// is only checked when no proxy session has connected to it since the last
+// check, and then only every 30 seconds. A backend is removed after
+// consecutive failed checks, or immediately if a session fails to connect.
+// A removed backend is checked every 2 seconds, and is restored by the first
+// successful check.
+//
+
+#define MAXIMUM_BACKENDS      32
+
+// Session exit code when unable to connect to the backend.
+//
+#define PROXY_CONNECT_FAILED  5
+
+enum BalancePolicy {
+   bpLeastConnections,
+   bpConsistentHash        // on client IPv4/IPv6 address
+};
+
+struct Backend {
+   char name [80];            // as specified, i.e. host:port
+   struct sockaddr_storage address;
+   socklen_t addressSize;
+   bool isHealthy;
+   int numberRunning;
+   int failures;              // consecutive failed checks
+   bool isInUse;              // a session connected since the last check
+   uint32_t connectFailuresSeen;
+   int checkFd;               // connect in progress or -1
+   double checkStartTime;
+   double nextCheckTime;
+};
+
+struct ProxyBackends {
+   BalancePolicy balance;
+   int number;
+   Backend backends [MAXIMUM_BACKENDS];
+   int numberPoints;          // consistent hash ring
+   struct RingPoint {
+      uint32_t hash;
+      int backend;
+   } ring [MAXIMUM_BACKENDS * 64];
+   uint32_t* connectFailures; // per backend, shared with the session processes
+};
+
+// Parses 'least' or 'hash'. Returns false if invalid.
+//
+bool parseBalancePolicy (const char* text, BalancePolicy& balance);
+
+// Creates the backends from a comma separated list of host:port.
+// Returns NULL (and reports the error) if invalid.
+//
+ProxyBackends* createProxyBackends (const char* list, const BalancePolicy balance);
+
+// Chooses the backend for a new session and counts it as running. For the
+// hash policy, the client's IPv4 or IPv6 address is hashed; other address
+// families (e.g. unix sockets) all hash alike.
+// Returns -1 if there are no healthy backends.
+//
+int chooseBackend (ProxyBackends* proxy, const struct sockaddr* clientAddress);
+
+// Releases a backend on session completion. If the session could not
+// connect to any backend, the backend is removed until the next successful
+// check.
+//
+void releaseBackend (ProxyBackends* proxy, const int backend, const bool connectFailed);
+
+// Progresses the health checks - does not block.
+//
+void checkBackends (ProxyBackends* proxy, const double timeNow);
+
+// Reports the backends to stdout.
+//
+void reportBackends (const ProxyBackends* proxy);
+
+// Connects to the backend and relays data between the connection and the
+// backend until both directions are complete. If the backend cannot be
+// connected, the other healthy backends are tried in turn (as per the balance
+// policy), and the failure is counted for checkBackends to remove the backend.
+// Exits with PROXY_CONNECT_FAILED if no backend could be connected.
+// NOTE: This function does not return.
+//
+void runProxySession (const int connectionFd, const ProxyBackends* proxy,
+                      const int backend, const struct sockaddr* clientAddress,
+                      const int pipeSize);
+
+#endif  // PROXY_H
@@ -0,0 +1,244 @@
+// reload.cpp
+//
+// Zero downtime reload and binary upgrade with listener hand off.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#include "reload.h"
+#include "utilities.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAXIMUM_ARGUMENTS     256
+#define READY_MESSAGE         "ready\n"
+
+static char executablePath [1024] = "";
+static char** originalArgv = NULL;
+static const char* reloadFilename = NULL;
+static volatile sig_atomic_t reloadRequested = 0;
+
+//------------------------------------------------------------------------------
+//
+static void hangupHandler (int)
+{
+   reloadRequested = 1;
+}
+
+//------------------------------------------------------------------------------
+//
+void initialiseReload (char** argv, const char* reloadFile)
+{
+   originalArgv = argv;
+   reloadFilename = reloadFile;
+
+   // Record our executable path now. If the executable is replaced (upgraded)
+   // /proc/self/exe would then refer to the old, deleted, file.
+   //
+   const ssize_t n = readlink ("/proc/self/exe", executablePath, sizeof (executablePath) - 1);
+   if (n > 0) {
+      executablePath [n] = '\0';
+   } else {
+      snprintf (executablePath, sizeof (executablePath), "%s", argv [0]);
+   }
+
+   struct sigaction action;
+   memset (&action, 0, sizeof (action));
+   action.sa_handler = hangupHandler;
+   sigemptyset (&action.sa_mask);
+   action.sa_flags = SA_RESTART;
+   if (sigaction (SIGHUP, &action, NULL) < 0) {
+      perrorf ("sigaction (SIGHUP, ...)");
+   }
+}
+
+//------------------------------------------------------------------------------
+//
+bool isReloadRequested ()
+{
+   if (!reloadRequested) return false;
+   reloadRequested = 0;
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Reads the reload file arguments, one per line, into argv. Returns the number
+// of arguments read, or -1 if the file could not be opened.
+//
+static int readReloadFile (char* argv[], const int maximum)
+{
+   FILE* file = fopen (reloadFilename, "r");
+   if (!file) return -1;
+
+   int number = 0;
+   char line [1024];
+   while ((number < maximum) && fgets (line, sizeof (line), file)) {
+      const size_t length = strlen (line);
+      if ((length > 0) && (line [length - 1] == '\n')) {
+         line [length - 1] = '\0';
+      }
+      if (strlen (line) == 0) continue;   // skip blank lines
+      argv [number++] = strdup (line);
+   }
+
+   fclose (file);
+   return number;
+}
+
+//------------------------------------------------------------------------------
+//
+pid_t startSuccessor (const int listenFds[], const char* const keys[],
+                      const int number, int& readyFd)
+{
+   int fd_set [2];
+
+   readyFd = -1;
+   if (pipe (fd_set) < 0) {
+      perrorf ("startSuccessor.pipe ()");
+      return -1;
+   }
+
+   const pid_t pid = fork ();
+   if (pid < 0) {
+      perrorf ("fork ()");
+      close (fd_set [0]);
+      close (fd_set [1]);
+      return -1;
+   }
+
+   if (pid > 0) {
+      // We are the parent (old server) process.
+      //
+      close (fd_set [1]);
+      readyFd = fd_set [0];
+      setNonBlocking (readyFd);
+      return pid;
+   }
+
+   // We are the child process - to become the successor.
+   // Build the argument list.
+   //
+   static char* argv [MAXIMUM_ARGUMENTS + 2];
+   int argc = 0;
+   argv [argc++] = executablePath;
+
+   int n = reloadFilename ? readReloadFile (&argv [1], MAXIMUM_ARGUMENTS) : -1;
+   if (n >= 0) {
+      argc += n;
+   } else {
+      for (int j = 1; originalArgv [j] && argc <= MAXIMUM_ARGUMENTS; j++) {
+         argv [argc++] = originalArgv [j];
+      }
+   }
+   argv [argc] = NULL;
+
+   // Pass listeners and readiness pipe via the environment.
+   //
+   char listeners [2000] = "";
+   for (int j = 0; j < number; j++) {
+      char item [300];
+      snprintf (item, sizeof (item), "%s%s=%d", j > 0 ? ";" : "", keys [j], listenFds [j]);
+      strncat (listeners, item, sizeof (listeners) - strlen (listeners) - 1);
+   }
+   setenv ("FILTER_SERVER_LISTENERS", listeners, 1);
+
+   char image [20];
+   snprintf (image, sizeof (image), "%d", fd_set [1]);
+   setenv ("FILTER_SERVER_READY_FD", image, 1);
+
+   // Close all other files, e.g. the retained connection sockets, so they will
+   // not be inherited by the successor.
+   //
+   close (fd_set [0]);
+   const int maxfd = sysconf (_SC_OPEN_MAX);
+   for (int tfd = 3; tfd <= maxfd; tfd++) {
+      bool keep = (tfd == fd_set [1]);
+      for (int j = 0; j < number; j++) {
+         if (tfd == listenFds [j]) keep = true;
+      }
+      if (!keep) close (tfd);
+   }
+
+   // The new process must start with SIGHUP at its default.
+   //
+   signal (SIGHUP, SIG_DFL);
+
+   fprintf (stdout, "Starting successor %s\n", executablePath);
+   fflush (stdout);
+
+   execv (executablePath, argv);
+
+   perrorf ("execv (%s , ...)", executablePath);
+   _exit (8);
+}
+
+//------------------------------------------------------------------------------
+//
+int checkSuccessor (const pid_t successorPid, int& readyFd)
+{
+   if (readyFd < 0) return -1;
+
+   char buffer [20];
+   const ssize_t n = read (readyFd, buffer, sizeof (buffer) - 1);
+   if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+      return 0;   // no news yet
+   }
+
+   close (readyFd);
+   readyFd = -1;
+
+   if ((n > 0) && (strncmp (buffer, READY_MESSAGE, n) == 0)) {
+      return +1;
+   }
+
+   // Successor failed to start - collect it.
+   //
+   int status;
+   waitpid (successorPid, &status, 0);
+   fprintf (stdout, "Successor %d failed, exit code: %d.\n", successorPid, status >> 8);
+   return -1;
+}
+
+//------------------------------------------------------------------------------
+//
+void notifyPredecessor ()
+{
+   const char* image = getenv ("FILTER_SERVER_READY_FD");
+   if (!image) return;
+
+   const int fd = atoi (image);
+   const ssize_t length = strlen (READY_MESSAGE);
+   if (write (fd, READY_MESSAGE, length) != length) {
+      perrorf ("notifyPredecessor.write (%d)", fd);
+   }
+   close (fd);
+
+   // Our own filter processes, and any successor, need not see this.
+   //
+   unsetenv ("FILTER_SERVER_READY_FD");
+}
+
+// end
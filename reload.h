@@ -0,0 +1,67 @@
+// reload.h
+//
+// Zero downtime reload and binary upgrade with listener hand off.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include <sys/types.h>
+
+// On SIGHUP the server starts a successor process, i.e. it forks and exec's
+// the (possibly upgraded) filter_server executable, passing the listening
+// socket(s) via the FILTER_SERVER_LISTENERS environment variable, e.g.
+// "tcp:4242=3". The listening sockets are never closed, so no connection
+// is refused. Once the successor has signalled that it is ready via the pipe
+// identified by FILTER_SERVER_READY_FD, the old server stops accepting new
+// connections and exits once its existing sessions have completed.
+// If the successor fails to start, the old server carries on as before.
+//
+// The successor's arguments are read from the reload file, one argument per
+// line, if specified and it exists, otherwise the original arguments are used.
+//
+
+// Records the executable path and original arguments, and installs the
+// SIGHUP handler.
+//
+void initialiseReload (char** argv, const char* reloadFile);
+
+// Returns true (once) if a SIGHUP has been received.
+//
+bool isReloadRequested ();
+
+// Starts the successor process, passing it the listening sockets.
+// Returns the successor pid (or -1 on failure) and the read end of the
+// readiness pipe in readyFd.
+//
+pid_t startSuccessor (const int listenFds[], const char* const keys[],
+                      const int number, int& readyFd);
+
+// Checks the readiness pipe. Returns +1 if the successor is ready, -1 if it
+// failed (pipe closed without notification) and 0 if no news yet.
+//
+int checkSuccessor (const pid_t successorPid, int& readyFd);
+
+// Notifies our predecessor, if any, that we are ready to accept connections.
+//
+void notifyPredecessor ();
+
+#endif  // RELOAD_H
@@ -0,0 +1,320 @@
+// scheduling.cpp
+//
+// CPU/NUMA placement and scheduling policy for filter processes.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#include "scheduling.h"
+#include "utilities.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define MAXIMUM_UNITS         256
+#define MAXIMUM_NODES         64
+
+// From linux/ioprio.h - not available on all systems.
+//
+#define IOPRIO_CLASS_SHIFT    13
+#define IOPRIO_CLASS_RT       1
+#define IOPRIO_CLASS_BE       2
+#define IOPRIO_CLASS_IDLE     3
+#define IOPRIO_WHO_PROCESS    1
+
+// Placement units, i.e. individual cores or the cores of each NUMA node.
+//
+static cpu_set_t unitCpus [MAXIMUM_UNITS];
+static int unitIdentity [MAXIMUM_UNITS];    // cpu or node number
+static int unitLoad [MAXIMUM_UNITS];        // number of sessions allocated
+static int numberUnits = 0;
+static int lastUnit = -1;
+
+//------------------------------------------------------------------------------
+//
+bool parsePinUnit (const char* text, PinUnit& unit)
+{
+   if (strcmp (text, "core") == 0) {
+      unit = puCore;
+   } else if (strcmp (text, "node") == 0) {
+      unit = puNode;
+   } else if (strcmp (text, "none") == 0) {
+      unit = puNone;
+   } else {
+      fprintf (stderr, "pin unit must be core, node or none\n");
+      return false;
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+bool parsePlacementPolicy (const char* text, PlacementPolicy& placement)
+{
+   if (strcmp (text, "rr") == 0) {
+      placement = ppRoundRobin;
+   } else if (strcmp (text, "least") == 0) {
+      placement = ppLeastLoaded;
+   } else {
+      fprintf (stderr, "placement must be rr or least\n");
+      return false;
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+bool parseSchedulingPolicy (const char* text, int& policy)
+{
+   if (strcmp (text, "other") == 0) {
+      policy = SCHED_OTHER;
+   } else if (strcmp (text, "batch") == 0) {
+      policy = SCHED_BATCH;
+   } else if (strcmp (text, "idle") == 0) {
+      policy = SCHED_IDLE;
+   } else {
+      fprintf (stderr, "scheduling policy must be other, batch or idle\n");
+      return false;
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+bool parseIoPriority (const char* text, int& ioprioClass, int& ioprioLevel)
+{
+   char name [20];
+   int level = 4;
+   const int n = sscanf (text, "%19[a-z]:%d", name, &level);
+   if (n < 1) {
+      fprintf (stderr, "invalid I/O priority %s\n", text);
+      return false;
+   }
+
+   if (strcmp (name, "rt") == 0) {
+      ioprioClass = IOPRIO_CLASS_RT;
+   } else if (strcmp (name, "be") == 0) {
+      ioprioClass = IOPRIO_CLASS_BE;
+   } else if (strcmp (name, "idle") == 0) {
+      ioprioClass = IOPRIO_CLASS_IDLE;
+      level = 0;
+   } else {
+      fprintf (stderr, "I/O priority class must be rt, be or idle\n");
+      return false;
+   }
+
+   if ((level < 0) || (level > 7)) {
+      fprintf (stderr, "I/O priority level must be in range 0 to 7\n");
+      return false;
+   }
+
+   ioprioLevel = level;
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Parses a kernel cpu list, e.g. "0-3,8-11", into a cpu set.
+//
+static void parseCpuList (const char* text, cpu_set_t* set)
+{
+   CPU_ZERO (set);
+
+   const char* p = text;
+   while (*p) {
+      char* end;
+      const long first = strtol (p, &end, 10);
+      if (end == p) break;
+      long last = first;
+      p = end;
+      if (*p == '-') {
+         p++;
+         last = strtol (p, &end, 10);
+         p = end;
+      }
+      for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+         CPU_SET (cpu, set);
+      }
+      if (*p == ',') p++;
+      else break;
+   }
+}
+
+//------------------------------------------------------------------------------
+//
+int initialiseScheduling (const SchedulingSettings* settings)
+{
+   numberUnits = 0;
+   if (settings->pinUnit == puNone) return 0;
+
+   // We only use CPUs we ourselves are allowed to run on.
+   //
+   cpu_set_t allowed;
+   if (sched_getaffinity (0, sizeof (allowed), &allowed) < 0) {
+      perrorf ("sched_getaffinity (0, ...)");
+      return 0;
+   }
+
+   if (settings->pinUnit == puCore) {
+      for (int cpu = 0; cpu < CPU_SETSIZE && numberUnits < MAXIMUM_UNITS; cpu++) {
+         if (CPU_ISSET (cpu, &allowed)) {
+            CPU_ZERO (&unitCpus [numberUnits]);
+            CPU_SET (cpu, &unitCpus [numberUnits]);
+            unitIdentity [numberUnits] = cpu;
+            unitLoad [numberUnits] = 0;
+            numberUnits++;
+         }
+      }
+
+   } else {
+      for (int node = 0; node < MAXIMUM_NODES; node++) {
+         char filename [80];
+         char cpulist [400];
+
+         snprintf (filename, sizeof (filename),
+                   "/sys/devices/system/node/node%d/cpulist", node);
+         FILE* file = fopen (filename, "r");
+         if (!file) continue;
+         const bool okay = fgets (cpulist, sizeof (cpulist), file) != NULL;
+         fclose (file);
+         if (!okay) continue;
+
+         cpu_set_t nodeCpus;
+         parseCpuList (cpulist, &nodeCpus);
+         CPU_AND (&nodeCpus, &nodeCpus, &allowed);
+         if (CPU_COUNT (&nodeCpus) == 0) continue;   // memory only or disallowed
+
+         unitCpus [numberUnits] = nodeCpus;
+         unitIdentity [numberUnits] = node;
+         unitLoad [numberUnits] = 0;
+         numberUnits++;
+      }
+   }
+
+   return numberUnits;
+}
+
+//------------------------------------------------------------------------------
+//
+int allocatePlacementUnit (const SchedulingSettings* settings)
+{
+   if (numberUnits <= 0) return -1;
+
+   int unit = (lastUnit + 1) % numberUnits;
+
+   if (settings->placement == ppLeastLoaded) {
+      // Start the search after the last allocated unit, so that ties are
+      // resolved in a round robin fashion.
+      //
+      int best = unit;
+      for (int j = 1; j < numberUnits; j++) {
+         const int candidate = (unit + j) % numberUnits;
+         if (unitLoad [candidate] < unitLoad [best]) {
+            best = candidate;
+         }
+      }
+      unit = best;
+   }
+
+   unitLoad [unit]++;
+   lastUnit = unit;
+   return unit;
+}
+
+//------------------------------------------------------------------------------
+//
+void releasePlacementUnit (const int unit)
+{
+   if ((unit >= 0) && (unit < numberUnits) && (unitLoad [unit] > 0)) {
+      unitLoad [unit]--;
+   }
+}
+
+//------------------------------------------------------------------------------
+//
+const char* placementUnitImage (const SchedulingSettings* settings, const int unit)
+{
+   static char image [40];
+
+   if ((unit < 0) || (unit >= numberUnits)) {
+      return "any cpu";
+   }
+
+   snprintf (image, sizeof (image), "%s %d",
+             settings->pinUnit == puNode ? "node" : "core", unitIdentity [unit]);
+   return image;
+}
+
+//------------------------------------------------------------------------------
+//
+void applyScheduling (const SchedulingSettings* settings, const int unit)
+{
+   int status;
+
+   if ((unit >= 0) && (unit < numberUnits)) {
+      status = sched_setaffinity (0, sizeof (cpu_set_t), &unitCpus [unit]);
+      if (status < 0) {
+         perrorf ("sched_setaffinity (0, %s)", placementUnitImage (settings, unit));
+      }
+
+      if (settings->pinUnit == puNode) {
+         // Prefer memory allocations from the same node. Preferred rather
+         // than bind, so we fall back gracefully when the node is full.
+         //
+         unsigned long nodeMask = 1UL << unitIdentity [unit];
+         status = syscall (SYS_set_mempolicy, MPOL_PREFERRED,
+                           &nodeMask, 8 * sizeof (nodeMask));
+         if (status < 0) {
+            perrorf ("set_mempolicy (MPOL_PREFERRED, node %d)", unitIdentity [unit]);
+         }
+      }
+   }
+
+   if (settings->policy >= 0) {
+      struct sched_param param;
+      memset (&param, 0, sizeof (param));
+      status = sched_setscheduler (0, settings->policy, &param);
+      if (status < 0) {
+         perrorf ("sched_setscheduler (0, %d)", settings->policy);
+      }
+   }
+
+   if (settings->setNice) {
+      status = setpriority (PRIO_PROCESS, 0, settings->nice);
+      if (status < 0) {
+         perrorf ("setpriority (PRIO_PROCESS, 0, %d)", settings->nice);
+      }
+   }
+
+   if (settings->ioprioClass > 0) {
+      const int ioprio = (settings->ioprioClass << IOPRIO_CLASS_SHIFT) |
+                         settings->ioprioLevel;
+      status = syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio);
+      if (status < 0) {
+         perrorf ("ioprio_set (%d, %d)", settings->ioprioClass, settings->ioprioLevel);
+      }
+   }
+}
+
+// end
@@ -0,0 +1,91 @@
+// scheduling.h
+//
+// CPU/NUMA placement and scheduling policy for filter processes.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#ifndef SCHEDULING_H
+#define SCHEDULING_H
+
+enum PinUnit {
+   puNone,
+   puCore,
+   puNode
+};
+
+enum PlacementPolicy {
+   ppRoundRobin,
+   ppLeastLoaded
+};
+
+// Specifies how each session's processes are placed and scheduled.
+//
+struct SchedulingSettings {
+   PinUnit pinUnit;
+   PlacementPolicy placement;
+   bool setNice;
+   int nice;
+   int policy;                // SCHED_OTHER, SCHED_BATCH, SCHED_IDLE or -1
+   int ioprioClass;           // 0 means not specified
+   int ioprioLevel;
+};
+
+// Parses a pin unit: "core" or "node".
+//
+bool parsePinUnit (const char* text, PinUnit& unit);
+
+// Parses a placement policy: "rr" or "least".
+//
+bool parsePlacementPolicy (const char* text, PlacementPolicy& placement);
+
+// Parses a scheduling policy: "other", "batch" or "idle".
+//
+bool parseSchedulingPolicy (const char* text, int& policy);
+
+// Parses an I/O priority: "be[:level]", "idle" or "rt[:level]".
+//
+bool parseIoPriority (const char* text, int& ioprioClass, int& ioprioLevel);
+
+// Discovers the available cores or NUMA nodes (as limited by our own CPU
+// affinity) to which sessions may be pinned.
+// Returns the number of units available, or 0 if none.
+//
+int initialiseScheduling (const SchedulingSettings* settings);
+
+// Selects the unit for a new session, per the placement policy.
+// Returns -1 if no pinning.
+//
+int allocatePlacementUnit (const SchedulingSettings* settings);
+
+// Releases the unit allocated to a complete session.
+//
+void releasePlacementUnit (const int unit);
+
+// Returns a text image of the unit, e.g. "core 3" or "node 1".
+//
+const char* placementUnitImage (const SchedulingSettings* settings, const int unit);
+
+// Applies the scheduling settings and placement to the calling process.
+// This is intended to be called by the child prior to creating any
+// pre/post processes, so that they inherit the same placement.
+//
+void applyScheduling (const SchedulingSettings* settings, const int unit);
+
+#endif  // SCHEDULING_H
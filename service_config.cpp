@@ -0,0 +1,343 @@
+// service_config.cpp
+//
+// Service definitions and configuration file reader.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#include "service_config.h"
+#include "utilities.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+//------------------------------------------------------------------------------
+// Removes leading and trailing white space, in situ.
+//
+static char* trim (char* text)
+{
+   while (isspace (*text)) text++;
+
+   char* end = text + strlen (text);
+   while ((end > text) && isspace (end [-1])) end--;
+   *end = '\0';
+
+   return text;
+}
+
+//------------------------------------------------------------------------------
+// Splits a command line into arguments. Arguments are separated by white space
+// and may be quoted using single or double quotes.
+// Returns the number of arguments, or -1 on error.
+//
+static int splitCommand (const char* text, const char* argv [], const int maximum)
+{
+   char buffer [1024];
+   int number = 0;
+   const char* p = text;
+
+   while (true) {
+      while (isspace (*p)) p++;
+      if (*p == '\0') break;
+
+      if (number >= maximum) {
+         return -1;
+      }
+
+      size_t length = 0;
+      char quote = '\0';
+      while (*p && (quote || !isspace (*p))) {
+         if (quote && (*p == quote)) {
+            quote = '\0';
+         } else if (!quote && ((*p == '\'') || (*p == '"'))) {
+            quote = *p;
+         } else if (length < sizeof (buffer) - 1) {
+            buffer [length++] = *p;
+         }
+         p++;
+      }
+
+      if (quote) {
+         return -1;   // unterminated quote
+      }
+
+      buffer [length] = '\0';
+      argv [number++] = strdup (buffer);
+   }
+
+   argv [number] = NULL;
+   return number;
+}
+
+//------------------------------------------------------------------------------
+//
+static bool parseBoolean (const char* text, bool& value)
+{
+   if ((strcmp (text, "yes") == 0) || (strcmp (text, "true") == 0) ||
+       (strcmp (text, "1") == 0)) {
+      value = true;
+   } else if ((strcmp (text, "no") == 0) || (strcmp (text, "false") == 0) ||
+              (strcmp (text, "0") == 0)) {
+      value = false;
+   } else {
+      return false;
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Applies one key = value setting to the service.
+// Returns false if invalid.
+//
+static bool applySetting (ServiceConfig* service, const char* key, const char* value)
+{
+   if (strcmp (key, "port") == 0) {
+      service->port = atoi (value);
+      return (service->port >= 1) && (service->port <= 65535);
+   }
+
+   if (strcmp (key, "socket") == 0) {
+      if (strlen (value) >= SOCKET_PATH_SIZE) return false;
+      snprintf (service->socketPath, sizeof (service->socketPath), "%s", value);
+      return true;
+   }
+
+   if (strcmp (key, "command") == 0) {
+      return splitCommand (value, service->argv, MAXIMUM_COMMAND_ARGS) > 0;
+   }
+
+   if (strcmp (key, "proxy") == 0) {
+      service->proxyList = strdup (value);
+      return true;
+   }
+
+   if (strcmp (key, "balance") == 0) {
+      return parseBalancePolicy (value, service->balance);
+   }
+
+   if (strcmp (key, "pipeline") == 0) {
+      return parseBoolean (value, service->isPipeline);
+   }
+
+   if (strcmp (key, "pipe-size") == 0) {
+      double size;
+      if (!parseSize (value, size)) return false;
+      service->pipeSize = int (size);
+      return true;
+   }
+
+   if (strcmp (key, "unzip") == 0) {
+      return parseBoolean (value, service->inputIsCompressed);
+   }
+
+   if (strcmp (key, "submit") == 0) {
+      return parseBoolean (value, service->isSubmit);
+   }
+
+   if (strcmp (key, "tls") == 0) {
+      return parseBoolean (value, service->isTls);
+   }
+
+   if (strcmp (key, "zip") == 0) {
+      return parseBoolean (value, service->doCompressOutput);
+   }
+
+   if (strcmp (key, "timeout") == 0) {
+      return parseDuration (value, service->maximumTime);
+   }
+
+   if (strcmp (key, "idle") == 0) {
+      return parseDuration (value, service->activityRules.idleTime);
+   }
+
+   if (strcmp (key, "min-rate") == 0) {
+      if (!parseSize (value, service->activityRules.minimumRate)) return false;
+      const char* period = strchr (value, ':');
+      return !period || parseDuration (period + 1, service->activityRules.ratePeriod);
+   }
+
+   if (strcmp (key, "min-sessions") == 0) {
+      service->minimumSessions = atoi (value);
+      return service->minimumSessions >= 0;
+   }
+
+   if (strcmp (key, "max-sessions") == 0) {
+      service->maximumSessions = atoi (value);
+      return service->maximumSessions >= 1;
+   }
+
+   if (strcmp (key, "weight") == 0) {
+      service->weight = atof (value);
+      return service->weight > 0.0;
+   }
+
+   return false;
+}
+
+//------------------------------------------------------------------------------
+//
+int readServiceConfig (const char* filename, const ServiceConfig* defaults,
+                       ServiceConfig services [], const int maximum)
+{
+   FILE* file = fopen (filename, "r");
+   if (!file) {
+      perrorf ("fopen (%s)", filename);
+      return -1;
+   }
+
+   int number = 0;
+   int lineNumber = 0;
+   ServiceConfig* service = NULL;
+   char line [1024];
+   bool okay = true;
+
+   while (okay && fgets (line, sizeof (line), file)) {
+      lineNumber++;
+
+      char* text = trim (line);
+      if ((text [0] == '\0') || (text [0] == '#')) continue;
+
+      if (text [0] == '[') {
+         // New service section.
+         //
+         char* end = strchr (text, ']');
+         if (!end) {
+            fprintf (stderr, "%s:%d: missing ]\n", filename, lineNumber);
+            okay = false;
+            break;
+         }
+         *end = '\0';
+
+         if (number >= maximum) {
+            fprintf (stderr, "%s:%d: too many services, maximum is %d\n",
+                     filename, lineNumber, maximum);
+            okay = false;
+            break;
+         }
+
+         service = &services [number++];
+         *service = *defaults;
+         snprintf (service->name, sizeof (service->name), "%s", trim (text + 1));
+         continue;
+      }
+
+      char* equals = strchr (text, '=');
+      if (!equals || !service) {
+         fprintf (stderr, "%s:%d: expecting [name] or key = value\n", filename, lineNumber);
+         okay = false;
+         break;
+      }
+
+      *equals = '\0';
+      const char* key = trim (text);
+      const char* value = trim (equals + 1);
+
+      if (!applySetting (service, key, value)) {
+         fprintf (stderr, "%s:%d: invalid setting %s = %s\n",
+                  filename, lineNumber, key, value);
+         okay = false;
+         break;
+      }
+   }
+
+   fclose (file);
+   if (!okay) return -1;
+
+   // Validate each service.
+   //
+   for (int j = 0; j < number; j++) {
+      service = &services [j];
+
+      if ((service->port == 0) == (service->socketPath [0] == '\0')) {
+         fprintf (stderr, "%s: service %s requires one of port or socket\n",
+                  filename, service->name);
+         return -1;
+      }
+
+      if (service->isSubmit && ((service->port > 0) || service->proxyList)) {
+         fprintf (stderr, "%s: service %s: submit requires a socket and a command\n",
+                  filename, service->name);
+         return -1;
+      }
+
+      if (service->isTls && ((service->port == 0) || service->proxyList)) {
+         fprintf (stderr, "%s: service %s: tls requires a port and a command\n",
+                  filename, service->name);
+         return -1;
+      }
+
+      const bool hasCommand = service->argv [0] && (strcmp (service->argv [0], "") != 0);
+      if (hasCommand == (service->proxyList != NULL)) {
+         fprintf (stderr, "%s: service %s requires one of command or proxy\n",
+                  filename, service->name);
+         return -1;
+      }
+
+      if (service->proxyList) {
+         service->proxy = createProxyBackends (service->proxyList, service->balance);
+         if (!service->proxy) {
+            fprintf (stderr, "%s: service %s has invalid backends\n", filename, service->name);
+            return -1;
+         }
+      } else if (!buildPipeline (service->argv, service->isPipeline, service->pipeSize,
+                                 &service->pipeline)) {
+         fprintf (stderr, "%s: service %s has an invalid command\n", filename, service->name);
+         return -1;
+      }
+
+      if (service->minimumSessions > service->maximumSessions) {
+         service->minimumSessions = service->maximumSessions;
+      }
+
+      // Sanitise as per the command line options.
+      //
+      if (service->maximumTime < 1.0) {
+         service->maximumTime = 1.0;
+      }
+
+      if (service->activityRules.idleTime < 1.0) {
+         service->activityRules.idleTime = 1.0;
+      }
+
+      if (service->activityRules.ratePeriod < 1.0) {
+         service->activityRules.ratePeriod = 1.0;
+      }
+
+      setServiceListenerKey (service);
+   }
+
+   return number;
+}
+
+//------------------------------------------------------------------------------
+//
+void setServiceListenerKey (ServiceConfig* service)
+{
+   if (service->port > 0) {
+      snprintf (service->listenerKey, sizeof (service->listenerKey),
+                "tcp:%d", service->port);
+   } else {
+      snprintf (service->listenerKey, sizeof (service->listenerKey),
+                "unix:%s", service->socketPath);
+   }
+}
+
+// end
@@ -0,0 +1,104 @@
+// service_config.h
+//
+// Service definitions and configuration file reader.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+#ifndef SERVICE_CONFIG_H
+#define SERVICE_CONFIG_H
+
+#define MAXIMUM_SERVICES      32
+#define MAXIMUM_COMMAND_ARGS  64
+#define SOCKET_PATH_SIZE      108      // as per sockaddr_un.sun_path
+
+#include "pipeline.h"
+#include "proxy.h"
+
+// Session rules based on server observed I/O.
+//
+struct ActivityRules {
+   double idleTime;           // maximum idle time
+   double minimumRate;        // bytes/second, 0.0 means no minimum
+   double ratePeriod;         // period over which minimum rate is assessed
+};
+
+// Defines a service, i.e. a listener (TCP port or unix socket path) and the
+// filter command run for each connection.
+//
+struct ServiceConfig {
+   char name [64];
+   int port;                                  // 0 if a unix socket
+   char socketPath [SOCKET_PATH_SIZE];        // empty if a TCP port
+   const char* argv [MAXIMUM_COMMAND_ARGS + 1];  // command and args, NULL terminated
+   bool isPipeline;           // "|" arguments separate pipeline stages
+   int pipeSize;              // default pipe size, 0 for system default
+   const char* proxyList;     // backends host:port,... or NULL if a filter
+   BalancePolicy balance;
+   bool inputIsCompressed;
+   bool doCompressOutput;
+   bool isSubmit;             // files passed over unix socket, see submit.h
+   bool isTls;                // TLS termination, TCP command services only
+   double maximumTime;
+   ActivityRules activityRules;
+   int minimumSessions;       // sessions reserved for this service
+   int maximumSessions;
+   double weight;             // share of the global session budget
+
+   // Run time data.
+   //
+   Pipeline pipeline;         // argv split into stages
+   ProxyBackends* proxy;      // NULL unless proxy mode
+   char listenerKey [SOCKET_PATH_SIZE + 8];
+   int listenFd;
+   int numberRunning;
+};
+
+// Reads the configuration file. Services take their default settings from
+// defaults, overridden by the settings in the file.
+// Returns the number of services read, or -1 on error.
+//
+// Format:
+//    # comment
+//    [name]
+//    port = 4242                 or   socket = /path/to/socket
+//    command = tr 'a-z' 'A-Z'    or   command = gunzip | sort |1M uniq -c
+//                                or   proxy = host1:4242,host2:4242
+//    balance = least|hash
+//    pipe-size = 256k
+//    unzip = yes|no
+//    zip = yes|no
+//    submit = yes|no             (socket only)
+//    tls = yes|no                (port only, requires --tls-cert)
+//    timeout = 1h
+//    idle = 30
+//    min-rate = 1k:60
+//    min-sessions = 2
+//    max-sessions = 10
+//    weight = 2
+//
+int readServiceConfig (const char* filename, const ServiceConfig* defaults,
+                       ServiceConfig services [], const int maximum);
+
+// Sets the service's listener key, e.g. "tcp:4242" or "unix:/path", used to
+// identify listeners handed over on reload.
+//
+void setServiceListenerKey (ServiceConfig* service);
+
+#endif  // SERVICE_CONFIG_H
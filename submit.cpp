@@ -0,0 +1,197 @@
+// submit.cpp
+//
+// Local job submission by passing file descriptors over a unix socket.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+
+#include "submit.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define MAXIMUM_FDS           2
+#define MAGIC_SIZE            (sizeof (SUBMIT_MAGIC) - 1)
+#define STATUS_SIZE           (MAGIC_SIZE + sizeof (int32_t))
+
+//------------------------------------------------------------------------------
+//
+bool sendSubmission (const int socketFd, const int inputFd, const int outputFd)
+{
+   const int fds [MAXIMUM_FDS] = { inputFd, outputFd };
+   const int number = MAXIMUM_FDS;
+
+   char data [] = SUBMIT_MAGIC;
+   struct iovec iov;
+   iov.iov_base = data;
+   iov.iov_len = sizeof (data) - 1;
+
+   union {
+      char buffer [CMSG_SPACE (sizeof (fds))];
+      struct cmsghdr align;
+   } control;
+   memset (&control, 0, sizeof (control));
+
+   struct msghdr message;
+   memset (&message, 0, sizeof (message));
+   message.msg_iov = &iov;
+   message.msg_iovlen = 1;
+   message.msg_control = control.buffer;
+   message.msg_controllen = CMSG_SPACE (number * sizeof (int));
+
+   struct cmsghdr* cmsg = CMSG_FIRSTHDR (&message);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN (number * sizeof (int));
+   memcpy (CMSG_DATA (cmsg), fds, number * sizeof (int));
+
+   if (sendmsg (socketFd, &message, 0) < 0) {
+      perror ("sendmsg (SCM_RIGHTS)");
+      return false;
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+bool receiveSubmission (const int socketFd, const double timeout,
+                        int& inputFd, int& outputFd)
+{
+   inputFd = -1;
+   outputFd = -1;
+
+   struct pollfd item;
+   item.fd = socketFd;
+   item.events = POLLIN;
+   item.revents = 0;
+   const int status = poll (&item, 1, int (1000.0 * timeout));
+   if (status <= 0) {
+      fprintf (stderr, "no submission received\n");
+      return false;
+   }
+
+   char data [sizeof (SUBMIT_MAGIC)];
+   struct iovec iov;
+   iov.iov_base = data;
+   iov.iov_len = sizeof (data) - 1;
+
+   union {
+      char buffer [CMSG_SPACE (MAXIMUM_FDS * sizeof (int))];
+      struct cmsghdr align;
+   } control;
+
+   struct msghdr message;
+   memset (&message, 0, sizeof (message));
+   message.msg_iov = &iov;
+   message.msg_iovlen = 1;
+   message.msg_control = control.buffer;
+   message.msg_controllen = sizeof (control.buffer);
+
+   const ssize_t n = recvmsg (socketFd, &message, MSG_WAITALL);
+   if (n < 0) {
+      perror ("recvmsg (SCM_RIGHTS)");
+      return false;
+   }
+
+   // Extract the file descriptors, if any.
+   //
+   int fds [MAXIMUM_FDS];
+   int number = 0;
+   for (struct cmsghdr* cmsg = CMSG_FIRSTHDR (&message); cmsg;
+        cmsg = CMSG_NXTHDR (&message, cmsg)) {
+      if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+         number = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+         if (number > MAXIMUM_FDS) number = MAXIMUM_FDS;
+         memcpy (fds, CMSG_DATA (cmsg), number * sizeof (int));
+      }
+   }
+
+   if ((n != ssize_t (sizeof (data) - 1)) ||
+       (memcmp (data, SUBMIT_MAGIC, sizeof (data) - 1) != 0) ||
+       (number != MAXIMUM_FDS) || (message.msg_flags & MSG_CTRUNC)) {
+      fprintf (stderr, "invalid submission\n");
+      for (int j = 0; j < number; j++) close (fds [j]);
+      return false;
+   }
+
+   inputFd = fds [0];
+   outputFd = fds [1];
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+bool sendSubmissionStatus (const int socketFd, const int waitStatus)
+{
+   int32_t exitStatus = -1;
+   if (WIFEXITED (waitStatus)) {
+      exitStatus = WEXITSTATUS (waitStatus);
+   } else if (WIFSIGNALED (waitStatus)) {
+      exitStatus = 128 + WTERMSIG (waitStatus);
+   }
+
+   char data [STATUS_SIZE];
+   memcpy (data, SUBMIT_MAGIC, MAGIC_SIZE);
+   memcpy (data + MAGIC_SIZE, &exitStatus, sizeof (exitStatus));
+
+   const ssize_t n = send (socketFd, data, sizeof (data), MSG_DONTWAIT | MSG_NOSIGNAL);
+   return n == ssize_t (sizeof (data));
+}
+
+//------------------------------------------------------------------------------
+//
+bool receiveSubmissionStatus (const int socketFd, int& exitStatus)
+{
+   char data [STATUS_SIZE + 1];
+   size_t total = 0;
+
+   // Read until end of file, which may follow the status message if the
+   // output is still being written.
+   //
+   while (true) {
+      const ssize_t n = read (socketFd, data + total, sizeof (data) - total);
+      if (n == 0) break;
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         perror ("read");
+         return false;
+      }
+      total += n;
+      if (total >= sizeof (data)) break;
+   }
+
+   if ((total != STATUS_SIZE) || (memcmp (data, SUBMIT_MAGIC, MAGIC_SIZE) != 0)) {
+      fprintf (stderr, "no job status received\n");
+      return false;
+   }
+
+   int32_t value;
+   memcpy (&value, data + MAGIC_SIZE, sizeof (value));
+   exitStatus = value;
+   return true;
+}
+
+// end
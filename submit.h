@@ -0,0 +1,66 @@
+// submit.h
+//
+// Local job submission by passing file descriptors over a unix socket.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+
+#ifndef SUBMIT_H
+#define SUBMIT_H
+
+// On a submission service (a unix domain socket), a local client passes an
+// open input file and an open output file (which may be a pipe) as SCM_RIGHTS
+// ancillary data on a single message sent immediately after connecting. The
+// filter reads from and writes to these files directly, so no data passes
+// through the connection.
+//
+// When the filter exits, the server sends a status message on the connection,
+// i.e. SUBMIT_MAGIC followed by the filter's exit status as a 32 bit integer
+// (128 + n if killed by signal n). The connection is also held open by the
+// last writer of the output (e.g. the gzip process when compressing), so the
+// client knows the output is complete when it then reads end of file.
+//
+
+// The message data that accompanies the file descriptors.
+//
+#define SUBMIT_MAGIC          "FSUB"
+
+// Sends the file descriptors.
+// Returns false (and reports the error) on failure.
+//
+bool sendSubmission (const int socketFd, const int inputFd, const int outputFd);
+
+// Receives the file descriptors, waiting up to timeout seconds.
+// Returns false (and reports the error) on failure.
+//
+bool receiveSubmission (const int socketFd, const double timeout,
+                        int& inputFd, int& outputFd);
+
+// Sends the status message, waitStatus as per waitpid. Does not block.
+// Returns false on failure, e.g. the client has gone away.
+//
+bool sendSubmissionStatus (const int socketFd, const int waitStatus);
+
+// Waits for the status message and then end of file, i.e. job completion.
+// Returns false (and reports the error) on failure.
+//
+bool receiveSubmissionStatus (const int socketFd, int& exitStatus);
+
+#endif  // SUBMIT_H
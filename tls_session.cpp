@@ -0,0 +1,366 @@
+// tls_session.cpp
+//
+// TLS termination using OpenSSL, with kernel TLS offload.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+
+#include "tls_session.h"
+#include "utilities.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#ifdef HAVE_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define RELAY_BUFFER_SIZE     65536
+
+static SSL_CTX* context = NULL;
+
+//------------------------------------------------------------------------------
+//
+static void reportTlsError (const char* what)
+{
+   fprintf (stderr, "%s failed\n", what);
+   ERR_print_errors_fp (stderr);
+}
+
+//------------------------------------------------------------------------------
+//
+bool initialiseTls (const char* certFile, const char* keyFile)
+{
+   context = SSL_CTX_new (TLS_server_method ());
+   if (!context) {
+      reportTlsError ("SSL_CTX_new");
+      return false;
+   }
+
+   SSL_CTX_set_min_proto_version (context, TLS1_2_VERSION);
+   SSL_CTX_set_mode (context, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                              SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+   SSL_CTX_set_options (context, SSL_OP_ENABLE_KTLS);
+#endif
+
+   // Session tickets are enabled by default. The ticket keys are created
+   // here, so are common to all sessions.
+   //
+   const unsigned char sessionContext [] = "filter_server";
+   SSL_CTX_set_session_id_context (context, sessionContext, sizeof (sessionContext) - 1);
+
+   if (SSL_CTX_use_certificate_chain_file (context, certFile) != 1) {
+      reportTlsError (certFile);
+      return false;
+   }
+
+   if (SSL_CTX_use_PrivateKey_file (context, keyFile ? keyFile : certFile,
+                                    SSL_FILETYPE_PEM) != 1) {
+      reportTlsError (keyFile ? keyFile : certFile);
+      return false;
+   }
+
+   if (SSL_CTX_check_private_key (context) != 1) {
+      reportTlsError ("SSL_CTX_check_private_key");
+      return false;
+   }
+
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+bool isTlsEnabled ()
+{
+   return context != NULL;
+}
+
+//------------------------------------------------------------------------------
+//
+static void setSocketTimeout (const int fd, const double timeout)
+{
+   struct timeval tv;
+   tv.tv_sec = time_t (timeout);
+   tv.tv_usec = suseconds_t (1.0e6 * (timeout - double (tv.tv_sec)));
+   setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+   setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+}
+
+//------------------------------------------------------------------------------
+// Relays data between the TLS connection and the filter pipes.
+// toFilter is the write end of the filter's standard input pipe, fromFilter
+// is the read end of the filter's standard output pipe. The relay is complete
+// when the filter's output is complete.
+// NOTE: This function does not return.
+//
+static void runTlsRelay (SSL* ssl, const int socketFd, int toFilter,
+                         const int fromFilter, const bool isKtlsSend)
+{
+   signal (SIGPIPE, SIG_IGN);
+   setNonBlocking (socketFd);
+   setNonBlocking (toFilter);
+   setNonBlocking (fromFilter);
+
+   char* inBuffer = new char [RELAY_BUFFER_SIZE];
+   size_t inOffset = 0;
+   size_t inLength = 0;
+   bool isInputEnd = false;
+
+   char* outBuffer = new char [RELAY_BUFFER_SIZE];
+   size_t outOffset = 0;
+   size_t outLength = 0;
+   bool isOutputEnd = false;
+
+   while (!isOutputEnd) {
+      bool wantSocketRead = false;
+      bool wantSocketWrite = false;
+      bool wantFilterWrite = false;
+      bool wantFilterRead = false;
+      bool progress = false;
+
+      // Client to filter.
+      //
+      if (toFilter >= 0) {
+         if ((inOffset == inLength) && !isInputEnd) {
+            const int n = SSL_read (ssl, inBuffer, RELAY_BUFFER_SIZE);
+            if (n > 0) {
+               inOffset = 0;
+               inLength = n;
+               progress = true;
+            } else {
+               const int error = SSL_get_error (ssl, n);
+               if (error == SSL_ERROR_WANT_READ) {
+                  wantSocketRead = true;
+               } else if (error == SSL_ERROR_WANT_WRITE) {
+                  wantSocketWrite = true;
+               } else {
+                  // close_notify, or the connection closed/failed.
+                  //
+                  isInputEnd = true;
+               }
+            }
+         }
+
+         if (inOffset < inLength) {
+            const ssize_t n = write (toFilter, inBuffer + inOffset, inLength - inOffset);
+            if (n > 0) {
+               inOffset += n;
+               progress = true;
+            } else if ((errno == EAGAIN) || (errno == EINTR)) {
+               wantFilterWrite = true;
+            } else {
+               // The filter is no longer reading its input.
+               //
+               inOffset = inLength;
+               isInputEnd = true;
+            }
+         }
+
+         if (isInputEnd && (inOffset == inLength)) {
+            close (toFilter);    // filter sees end of file
+            toFilter = -1;
+         }
+      }
+
+      // Filter to client.
+      //
+      if (isKtlsSend) {
+         // The kernel encrypts, so splice directly from the pipe to the socket.
+         //
+         const ssize_t n = splice (fromFilter, NULL, socketFd, NULL, RELAY_BUFFER_SIZE,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+         if (n > 0) {
+            progress = true;
+         } else if (n == 0) {
+            isOutputEnd = true;
+         } else if ((errno == EAGAIN) || (errno == EINTR)) {
+            if (isReadable (fromFilter)) {
+               wantSocketWrite = true;
+            } else {
+               wantFilterRead = true;
+            }
+         } else {
+            _exit (6);
+         }
+
+      } else {
+         if (outOffset == outLength) {
+            const ssize_t n = read (fromFilter, outBuffer, RELAY_BUFFER_SIZE);
+            if (n > 0) {
+               outOffset = 0;
+               outLength = n;
+               progress = true;
+            } else if (n == 0) {
+               isOutputEnd = true;
+            } else if ((errno == EAGAIN) || (errno == EINTR)) {
+               wantFilterRead = true;
+            } else {
+               isOutputEnd = true;
+            }
+         }
+
+         if (outOffset < outLength) {
+            const int n = SSL_write (ssl, outBuffer + outOffset, int (outLength - outOffset));
+            if (n > 0) {
+               outOffset += n;
+               progress = true;
+            } else {
+               const int error = SSL_get_error (ssl, n);
+               if (error == SSL_ERROR_WANT_WRITE) {
+                  wantSocketWrite = true;
+               } else if (error == SSL_ERROR_WANT_READ) {
+                  wantSocketRead = true;
+               } else {
+                  _exit (6);    // typically connection reset by the client
+               }
+            }
+         }
+      }
+
+      if (progress || isOutputEnd) continue;
+
+      struct pollfd items [3];
+      items [0].fd = socketFd;
+      items [0].events = (wantSocketRead ? POLLIN : 0) | (wantSocketWrite ? POLLOUT : 0);
+      items [1].fd = wantFilterWrite ? toFilter : -1;
+      items [1].events = POLLOUT;
+      items [2].fd = wantFilterRead ? fromFilter : -1;
+      items [2].events = POLLIN;
+
+      const int status = poll (items, 3, -1);
+      if ((status < 0) && (errno != EINTR)) {
+         perror ("runTlsRelay.poll");
+         _exit (4);
+      }
+   }
+
+   // All the filter's output has been sent - send close_notify.
+   //
+   const int flags = fcntl (socketFd, F_GETFL, 0);
+   fcntl (socketFd, F_SETFL, flags & ~O_NONBLOCK);
+   SSL_shutdown (ssl);
+   _exit (0);
+}
+
+//------------------------------------------------------------------------------
+//
+bool startTlsSession (const int connectionFd, const double timeout,
+                      int& inputFd, int& outputFd)
+{
+   SSL* ssl = SSL_new (context);
+   if (!ssl) {
+      reportTlsError ("SSL_new");
+      return false;
+   }
+   SSL_set_fd (ssl, connectionFd);
+
+   // Bound the time a client may take to complete the handshake.
+   //
+   setSocketTimeout (connectionFd, timeout);
+   if (SSL_accept (ssl) != 1) {
+      reportTlsError ("SSL_accept");
+      return false;
+   }
+   setSocketTimeout (connectionFd, 0.0);
+
+#ifdef BIO_get_ktls_send
+   const bool isKtlsSend = BIO_get_ktls_send (SSL_get_wbio (ssl));
+   const bool isKtlsReceive = BIO_get_ktls_recv (SSL_get_rbio (ssl));
+#else
+   const bool isKtlsSend = false;
+   const bool isKtlsReceive = false;
+#endif
+
+   fprintf (stderr, "Process %d %s %s%s, kTLS send %s, receive %s\n", getpid (),
+            SSL_get_version (ssl), SSL_get_cipher_name (ssl),
+            SSL_session_reused (ssl) ? " (resumed)" : "",
+            isKtlsSend ? "yes" : "no", isKtlsReceive ? "yes" : "no");
+
+   int inPipe [2];
+   int outPipe [2];
+   if ((pipe (inPipe) < 0) || (pipe (outPipe) < 0)) {
+      perrorf ("startTlsSession.pipe()");
+      return false;
+   }
+
+   const pid_t pid = fork ();
+   if (pid < 0) {
+      perrorf ("fork ()");
+      return false;
+   }
+
+   if (pid == 0) {
+      // We are the relay process. Close all other files, e.g. connections
+      // retained by the server for other sessions.
+      //
+      const int maxfd = sysconf (_SC_OPEN_MAX);
+      for (int tfd = 3; tfd <= maxfd; tfd++) {
+         if ((tfd != connectionFd) && (tfd != inPipe [1]) && (tfd != outPipe [0])) {
+            close (tfd);
+         }
+      }
+      runTlsRelay (ssl, connectionFd, inPipe [1], outPipe [0], isKtlsSend);
+   }
+
+   // We are the session process - the filter uses the other ends of the pipes.
+   //
+   close (inPipe [1]);
+   close (outPipe [0]);
+   inputFd = inPipe [0];
+   outputFd = outPipe [1];
+   return true;
+}
+
+#else   // !HAVE_TLS
+
+//------------------------------------------------------------------------------
+//
+bool initialiseTls (const char*, const char*)
+{
+   fprintf (stderr, "filter_server was built without TLS support (OpenSSL)\n");
+   return false;
+}
+
+//------------------------------------------------------------------------------
+//
+bool isTlsEnabled ()
+{
+   return false;
+}
+
+//------------------------------------------------------------------------------
+//
+bool startTlsSession (const int, const double, int&, int&)
+{
+   return false;
+}
+
+#endif  // HAVE_TLS
+
+// end
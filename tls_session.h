@@ -0,0 +1,63 @@
+// tls_session.h
+//
+// TLS termination using OpenSSL, with kernel TLS offload.
+//
+// Copyright (c) 2020 Andrew Starritt
+//
+// The filter server program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The filter server program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// the filter server program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Author: Andrew Starritt
+// Contact details:  andrew.starritt@gmail.com
+//
+
+
+#ifndef TLS_SESSION_H
+#define TLS_SESSION_H
+
+// TLS termination is only available if built with OpenSSL, i.e. HAVE_TLS
+// defined - see Makefile.
+//
+// The server's SSL context is created in the server process, prior to any
+// fork, so all sessions share the same session ticket keys. This allows a
+// client to resume a session, i.e. avoid a full handshake, on a subsequent
+// connection even though each session is handled by a different process.
+//
+// Each session performs the handshake in the session process, and then
+// forks a relay process that connects the TLS connection with the filter's
+// standard input and output pipes. Where the kernel supports kernel TLS
+// (kTLS) for the negotiated cipher, the record encryption/decryption is done
+// by the kernel, and the filter output is spliced from the pipe directly to
+// the socket. Otherwise the relay uses OpenSSL to read and write records.
+//
+
+// Creates the server SSL context using the certificate and private key
+// (PEM) files. keyFile may be NULL if the key is in the certificate file.
+// Returns false (and reports the error) on failure.
+//
+bool initialiseTls (const char* certFile, const char* keyFile);
+
+// Returns true if TLS has been initialised.
+//
+bool isTlsEnabled ();
+
+// Performs the TLS handshake on the connection, waiting up to timeout
+// seconds, and starts the relay process. On success, inputFd and outputFd
+// are the pipe ends to be connected to the filter's standard input and
+// output. Called in the session process.
+// Returns false (and reports the error) on failure.
+//
+bool startTlsSession (const int connectionFd, const double timeout,
+                      int& inputFd, int& outputFd);
+
+#endif  // TLS_SESSION_H
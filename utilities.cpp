@@ -22,13 +22,22 @@
 //
 
 #include "utilities.h"
+#include "probes.h"
+#include "capture.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
 
 #define MAXHOSTNAME           256
 
@@ -94,6 +103,19 @@ void setNonBlocking (const int fd)
    }
 }
 
+//------------------------------------------------------------------------------
+//
+bool isReadable (const int fd)
+{
+   struct pollfd item;
+   item.fd = fd;
+   item.events = POLLIN;
+   item.revents = 0;
+
+   const int status = poll (&item, 1, 0);
+   return (status > 0) && (item.revents & POLLIN);
+}
+
 //------------------------------------------------------------------------------
 //
 double getTimeSinceStart ()
@@ -108,15 +130,127 @@ double getTimeSinceStart ()
    return result;
 }
 
+//------------------------------------------------------------------------------
+// Parses a time duration, expressed in seconds, optionally qualified with
+// m, h, d or w for minutes, hours, days and weeks respectively.
+// Returns false if the text is not a valid duration.
+//
+bool parseDuration (const char* text, double& duration)
+{
+   long value = 0;
+   char xx = ' ';
+   int n = sscanf (text, "%ld%c", &value, &xx);
+   if (n < 1) {
+      // We expect at least one value.
+      //
+      return false;
+   }
+
+   if ((n == 1) || (xx == ' ')) {
+      // Just treat value as expressed in seconds.
+      //
+      duration = double (value);
+   } else if (xx == 'm') {
+      duration = 60.0 * double (value);
+   } else if (xx == 'h') {
+      duration = 3600.0 * double (value);
+   } else if (xx == 'd') {
+      duration = 86400.0 * double (value);
+   } else if (xx == 'w') {
+      duration = 604800.0 * double (value);
+   } else {
+      fprintf (stderr, "usage - timeout modifier %c\n", xx);
+      return false;
+   }
+
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Parses a size or rate, optionally qualified with k, M or G (powers of 1024).
+// Returns false if the text is not a valid size.
+//
+bool parseSize (const char* text, double& size)
+{
+   double value = 0.0;
+   char xx = ' ';
+   int n = sscanf (text, "%lf%c", &value, &xx);
+   if (n < 1) {
+      return false;
+   }
+
+   if ((n == 1) || (xx == ' ') || (xx == ':')) {
+      size = value;
+   } else if (xx == 'k') {
+      size = 1024.0 * value;
+   } else if (xx == 'M') {
+      size = 1048576.0 * value;
+   } else if (xx == 'G') {
+      size = 1073741824.0 * value;
+   } else {
+      fprintf (stderr, "usage - size modifier %c\n", xx);
+      return false;
+   }
+
+   return value >= 0.0;
+}
+
+//------------------------------------------------------------------------------
+//
+bool getConnectionByteCounts (const int fd, uint64_t& received, uint64_t& sent)
+{
+   struct tcp_info info;
+   socklen_t size = sizeof (info);
+
+   memset (&info, 0, sizeof (info));
+   const int status = getsockopt (fd, IPPROTO_TCP, TCP_INFO, &info, &size);
+   if (status < 0) {
+      return false;
+   }
+
+   // Older kernels do not provide the byte counts.
+   //
+   const size_t required = offsetof (struct tcp_info, tcpi_bytes_received) +
+                           sizeof (info.tcpi_bytes_received);
+   if (size < required) {
+      return false;
+   }
+
+   received = info.tcpi_bytes_received;
+   sent = info.tcpi_bytes_acked;
+   return true;
+}
+
+//------------------------------------------------------------------------------
+//
+bool getAcceptWait (const int fd, double& wait)
+{
+   struct tcp_info info;
+   socklen_t size = sizeof (info);
+
+   memset (&info, 0, sizeof (info));
+   const int status = getsockopt (fd, IPPROTO_TCP, TCP_INFO, &info, &size);
+   if (status < 0) {
+      return false;
+   }
+
+   wait = double (info.tcpi_last_ack_recv) / 1000.0;
+   return true;
+}
+
 //------------------------------------------------------------------------------
 // Allows casting of const char* const argv[]to a type acceptable to execvp
 // as in execvp (argv[0], ARGV (argv));
 //
 typedef char* const*  ARGV;
 
+// Held open by the last writer of the session's output, see runChildProcess.
+//
+static int completionFd = -1;
+
 //------------------------------------------------------------------------------
 //
-void createPreProcess (const char* const argv[])
+void createPreProcess (const char* const argv[], const int pipeSize)
 {
     int fd_set [2];
     int status;
@@ -128,6 +262,8 @@ void createPreProcess (const char* const argv[])
        _exit (4);   // terminates the child process
     }
 
+    setPipeSize (fd_set [0], pipeSize);
+
     pid = fork ();
     if (pid < 0) {
        perrorf ("fork ()");
@@ -154,6 +290,7 @@ void createPreProcess (const char* const argv[])
        // Close unsued end of pipe
        //
        close (fd_set [0]); // close input
+       if (completionFd >= 0) close (completionFd);
 
        int fd;
        fd = dup2 (fd_set [1], STDOUT_FILENO);
@@ -162,6 +299,10 @@ void createPreProcess (const char* const argv[])
           _exit (4);   // terminates the child process
        }
 
+       // The relay and capture stages are run in-server, i.e. without exec.
+       //
+       runBuiltinStage (argv);
+
        // Now exec to new pre process.
        //
        execvp (argv[0], ARGV (argv));
@@ -175,7 +316,7 @@ void createPreProcess (const char* const argv[])
 
 //------------------------------------------------------------------------------
 //
-void createPostProcess (const char* const argv[])
+void createPostProcess (const char* const argv[], const int pipeSize)
 {
    int fd_set [2];
    int status;
@@ -183,10 +324,12 @@ void createPostProcess (const char* const argv[])
 
    status = pipe (fd_set);
    if (status < 0) {
-      perrorf ("createPreProcess.pipe()");
+      perrorf ("createPostProcess.pipe()");
       _exit (4);   // terminates the child process
    }
 
+   setPipeSize (fd_set [0], pipeSize);
+
    pid = fork ();
    if (pid < 0) {
       perrorf ("fork ()");
@@ -200,6 +343,14 @@ void createPostProcess (const char* const argv[])
       //
       close (fd_set [0]); // close input
 
+      // The first post process created is the last writer of the output,
+      // so it alone retains the completion file descriptor.
+      //
+      if (completionFd >= 0) {
+         close (completionFd);
+         completionFd = -1;
+      }
+
       int fd;
       fd = dup2 (fd_set [1], STDOUT_FILENO);
       if (fd != STDOUT_FILENO) {
@@ -221,6 +372,10 @@ void createPostProcess (const char* const argv[])
          _exit (4);   // terminates the child process
       }
 
+      // The relay and capture stages are run in-server, i.e. without exec.
+      //
+      runBuiltinStage (argv);
+
       // Now exec to new post process.
       //
       execvp (argv[0], ARGV (argv));
@@ -232,23 +387,128 @@ void createPostProcess (const char* const argv[])
    }
 }
 
+//------------------------------------------------------------------------------
+// The exec cost can only be observed from outside the process being exec-ed.
+// The watcher process holds the read end of a close on exec pipe, from which
+// it reads the time just prior to the exec, and then sees end of file as soon
+// as the exec succeeds. It then reports the session phase timeline. The write
+// end of the pipe is returned, or -1 if the watcher could not be created.
+// The watcher is double forked, i.e. created by an intermediate child which
+// exits at once, so that it is reparented to init (or the nearest subreaper)
+// rather than becoming a child of the filter, which would never reap it.
+//
+static int startExecWatcher (const PhaseTimeline* timeline, const char* command)
+{
+   int fds [2];
+   if (pipe2 (fds, O_CLOEXEC) < 0) {
+      perrorf ("startExecWatcher.pipe2()");
+      return -1;
+   }
+
+   const pid_t sessionPid = getpid ();
+   const pid_t pid = fork ();
+   if (pid < 0) {
+      perrorf ("fork ()");
+      close (fds [0]);
+      close (fds [1]);
+      return -1;
+   }
+
+   if (pid > 0) {
+      close (fds [0]);
+
+      // Reap the intermediate child; the watcher itself is no longer ours.
+      //
+      int status = 0;
+      pid_t reaped;
+      while (((reaped = waitpid (pid, &status, 0)) < 0) && (errno == EINTR));
+      if ((reaped != pid) || !WIFEXITED (status) || (WEXITSTATUS (status) != 0)) {
+         close (fds [1]);
+         return -1;
+      }
+      return fds [1];
+   }
+
+   // We are the intermediate child.
+   //
+   close (fds [1]);
+   const pid_t watcherPid = fork ();
+   if (watcherPid < 0) {
+      perrorf ("fork ()");
+      _exit (1);
+   }
+   if (watcherPid > 0) {
+      _exit (0);
+   }
+
+   // We are the watcher. Don't hold on to the session's input or output.
+   //
+   close (STDIN_FILENO);
+   close (STDOUT_FILENO);
+
+   double execTime = 0.0;
+   bool isOkay = read (fds [0], &execTime, sizeof (execTime)) == ssize_t (sizeof (execTime));
+   char failed;
+   ssize_t n;
+   while (((n = read (fds [0], &failed, 1)) < 0) && (errno == EINTR));
+   const double execDoneTime = getTimeSinceStart ();
+   isOkay = isOkay && (n == 0);
+
+   if (isOkay) {
+      PROBE1 (exec_done, command);
+   }
+
+   // Report times relative to accept, in micro seconds.
+   //
+   #define RELATIVE(t) (1.0e6 * ((t) - timeline->acceptTime))
+
+   char acceptWait [20] = "n/a";
+   if (timeline->acceptWait >= 0.0) {
+      snprintf (acceptWait, sizeof (acceptWait), "%.1f", 1.0e6 * timeline->acceptWait);
+   }
+
+   char exec [20] = "failed";
+   if (isOkay) {
+      snprintf (exec, sizeof (exec), "%.1f", 1.0e6 * (execDoneTime - execTime));
+   }
+
+   fprintf (stderr, "Process %d phases (us): accept wait %s, accept->fork %.1f, "
+            "fork %.1f, close fds %.1f, helpers %.1f, exec %s, exec done at %.1f\n",
+            sessionPid, acceptWait,
+            RELATIVE (timeline->forkTime),
+            RELATIVE (timeline->childStartTime) - RELATIVE (timeline->forkTime),
+            RELATIVE (timeline->closeDoneTime) - RELATIVE (timeline->childStartTime),
+            RELATIVE (timeline->helpersDoneTime) - RELATIVE (timeline->closeDoneTime),
+            exec, RELATIVE (execDoneTime));
+
+   #undef RELATIVE
+
+   _exit (0);
+}
+
 //------------------------------------------------------------------------------
 // NOTE: This function does not return
 //
-void runChildProcess (const int connectionFd,
-                      const char* const argv[],
+void runChildProcess (const int inputFd,
+                      const int outputFd,
+                      const Pipeline* pipeline,
                       const bool inputIsCompressed,
-                      const bool doCompressOutput)
+                      const bool doCompressOutput,
+                      const SchedulingSettings* scheduling,
+                      const int placementUnit,
+                      const int holdFd,
+                      PhaseTimeline* timeline)
 {
-   // Connect standard IO to TCP/IP connection file descriptor fd
+   // Connect standard IO to TCP/IP connection file descriptor fd, or
+   // to the submitted files.
    //
-   int fdin = dup2 (connectionFd, STDIN_FILENO);
+   int fdin = dup2 (inputFd, STDIN_FILENO);
    if (fdin != STDIN_FILENO) {
       perror ("dup2 (fd, STDIN_FILENO)");
       _exit (4);   // terminates the child process
    }
 
-   int fdout = dup2 (connectionFd, STDOUT_FILENO);
+   int fdout = dup2 (outputFd, STDOUT_FILENO);
    if (fdout != STDOUT_FILENO) {
       perror ("dup2 (fd, STDOUT_FILENO)");
       _exit (4);   // terminates the child process
@@ -258,33 +518,100 @@ void runChildProcess (const int connectionFd,
    // close all open files except for STDIO so they will not
    // be inherited by the spawned process.
    //
-   // We "know" standard file descriptors are 0, 1 and 2
+   // We "know" standard file descriptors are 0, 1 and 2. The completion file
+   // descriptor, if any, is moved to 3 and retained.
    //
+   int firstfd = 3;
+   if (holdFd >= 0) {
+      completionFd = dup2 (holdFd, firstfd);
+      if (completionFd != firstfd) {
+         perror ("dup2 (fd, 3)");
+         _exit (4);   // terminates the child process
+      }
+      firstfd++;
+   }
+
    const int maxfd = sysconf (_SC_OPEN_MAX);
-   for (int tfd = 3; tfd <= maxfd; tfd++) {
+   PROBE1 (close_start, maxfd);
+   for (int tfd = firstfd; tfd <= maxfd; tfd++) {
       close (tfd);
    }
+   PROBE0 (close_done);
+   if (timeline) timeline->closeDoneTime = getTimeSinceStart ();
+
+   // Apply placement and scheduling policy before creating any pre/post
+   // processes so that they inherit the same, e.g. run on the same NUMA node
+   // as the filter.
+   //
+   applyScheduling (scheduling, placementUnit);
+
+   PROBE2 (helpers_start, inputIsCompressed, doCompressOutput);
+
+   if (isCaptureSession ()) {
+      // Create the capture processes next to the connection, i.e. before
+      // any other pre/post process.
+      //
+      const char* const ciargv[] = { CAPTURE_INPUT_STAGE, NULL };
+      createPreProcess (ciargv, pipeline->defaultPipeSize);
+
+      const char* const coargv[] = { CAPTURE_OUTPUT_STAGE, NULL };
+      createPostProcess (coargv, pipeline->defaultPipeSize);
+   }
 
    if (inputIsCompressed) {
       // Create a pre filter process to gunzip the input.
       //
       const char* const paargv[] = { "gunzip", NULL };
-      createPreProcess (paargv);
+      createPreProcess (paargv, pipeline->defaultPipeSize);
+   }
+
+   // Create the leading pipeline stages, each feeding the next stage.
+   // The pipe size applies to the pipe out of the stage.
+   //
+   const int last = pipeline->numberStages - 1;
+   for (int j = 0; j < last; j++) {
+      const int size = pipeline->pipeSize [j] > 0 ? pipeline->pipeSize [j]
+                                                  : pipeline->defaultPipeSize;
+      createPreProcess (pipeline->stageArgv [j], size);
    }
 
    if (doCompressOutput) {
       // Create a post filter process to gzip the output.
       //
       const char* const ppargv[] = { "gzip", NULL };
-      createPostProcess (ppargv);
+      createPostProcess (ppargv, pipeline->defaultPipeSize);
+   }
+
+   PROBE0 (helpers_done);
+
+   if (timeline) timeline->helpersDoneTime = getTimeSinceStart ();
+
+   // With no post process, the filter's exit is itself the completion.
+   //
+   if (completionFd >= 0) {
+      close (completionFd);
+      completionFd = -1;
    }
 
-   // Now exec to new process.
+   const char* const* argv = pipeline->stageArgv [last];
+   const int watchFd = timeline ? startExecWatcher (timeline, argv[0]) : -1;
+
+   // Now exec to new process, i.e. the last pipeline stage.
    //
+   if (watchFd >= 0) {
+      timeline->execTime = getTimeSinceStart ();
+      const ssize_t n = write (watchFd, &timeline->execTime, sizeof (timeline->execTime));
+      (void) n;
+   }
+   PROBE1 (exec, argv[0]);
    execvp (argv[0], ARGV (argv));
 
-   // The exec call failed.
+   // The exec call failed. Let the watcher know.
    //
+   if (watchFd >= 0) {
+      const ssize_t n = write (watchFd, "F", 1);
+      (void) n;
+   }
    perrorf ("execvp (%s , ...)", argv[0]);
 
    // Don't run our parent's atexit() handlers
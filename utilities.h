@@ -24,6 +24,10 @@
 #ifndef UTILITIES_H
 #define UTILITIES_H
 
+#include <stdint.h>
+#include "scheduling.h"
+#include "pipeline.h"
+
 // Allows improved perror reports
 //
 void perrorf (const char *format, ...);
@@ -36,23 +40,84 @@ void delay (const double duration);
 //
 void setNonBlocking (const int fd);
 
+// Returns true if the file descriptor is readable now, e.g. a listening socket
+// has a pending connection.
+//
+bool isReadable (const int fd);
+
 // Provides current time approx relative to program start.
 //
 double getTimeSinceStart ();
 
+// Parses a time duration, expressed in seconds, optionally qualified with
+// m, h, d or w for minutes, hours, days and weeks respectively.
+// Returns false if the text is not a valid duration.
+//
+bool parseDuration (const char* text, double& duration);
+
+// Parses a size or rate, optionally qualified with k, M or G (powers of 1024).
+// Returns false if the text is not a valid size.
+//
+bool parseSize (const char* text, double& size);
+
+// Obtains the number of bytes received from and sent to (and acknowledged by)
+// the peer of a TCP/IP connection, as observed by the kernel.
+// Returns false if not available, e.g. not a TCP socket.
+//
+bool getConnectionByteCounts (const int fd, uint64_t& received, uint64_t& sent);
+
+// Obtains an estimate of the time a newly accepted TCP/IP connection waited
+// to be accepted, i.e. the time since the last segment (normally the final
+// ACK of the handshake) was received from the peer. This is a lower bound,
+// with a resolution of one kernel tick, as any data received since resets it.
+// Returns false if not available, e.g. not a TCP socket.
+//
+bool getAcceptWait (const int fd, double& wait);
+
 // argv[0] | filter
+// If argv[0] is an in-server stage (see runBuiltinStage), the pre process is
+// a forked copy of the server rather than an exec-ed program.
+// The pipe capacity is set to pipeSize if this is greater than zero.
 //
-void createPreProcess (const char* const argv[]);
+void createPreProcess (const char* const argv[], const int pipeSize);
 
 // filter | argv[0]
 //
-void createPostProcess (const char* const argv[]);
+void createPostProcess (const char* const argv[], const int pipeSize);
+
+// Per session phase timeline, as recorded when --trace-phases specified.
+// Times are as per getTimeSinceStart.
+//
+struct PhaseTimeline {
+   double acceptWait;         // estimated wait before accept, seconds, or -1.0
+   double acceptTime;         // connection accepted
+   double forkTime;           // parent about to fork
+   double childStartTime;     // child running
+   double closeDoneTime;      // inherited file descriptors closed
+   double helpersDoneTime;    // gunzip/gzip and pipeline processes created
+   double execTime;           // about to exec the filter
+};
 
 // NOTE: This function does not return.
+// The filter's standard input and output are connected to inputFd and outputFd,
+// which are both the connection socket for a normal session.
+// All but the last pipeline stage are created as pre processes, the last
+// stage is exec-ed by the session process itself.
+// If holdFd is not -1, it is held open by the last writer of the output,
+// i.e. the outermost post process if any, and closed by all other processes,
+// so that the peer does not see end of file until the output is complete.
+// If timeline is not NULL, a watcher process is (double) forked to measure the
+// exec of the filter command and then report the session phase timeline to
+// stderr.
 //
-void runChildProcess (const int connectionFd,
-                      const char* const argv[],
+void runChildProcess (const int inputFd,
+                      const int outputFd,
+                      const Pipeline* pipeline,
                       const bool inputIsCompressed,
-                      const bool doCompressOutput);
+                      const bool doCompressOutput,
+                      const SchedulingSettings* scheduling,
+                      const int placementUnit,
+                      const int holdFd,
+                      PhaseTimeline* timeline);
 
 #endif // UTILITIES_H